@@ -1,6 +1,7 @@
 #include <linux/init.h>
 #include <linux/sched.h>
 #include <linux/module.h>
+#include <linux/moduleparam.h>
 #include <linux/types.h>
 #include <linux/kdev_t.h>
 #include <linux/fs.h>
@@ -12,10 +13,26 @@
 #include <linux/jiffies.h>
 #include <linux/timex.h>
 #include <linux/dma-mapping.h>
+#include <linux/interrupt.h>
+#include <linux/wait.h>
+#include <linux/spinlock.h>
+#include <linux/ktime.h>
+#include <linux/hash.h>
+#include <linux/mmu_notifier.h>
+#include <linux/vmalloc.h>
+#include <linux/mutex.h>
+#include <linux/bitmap.h>
+#include <linux/llist.h>
+#include <linux/percpu.h>
+#include <linux/poll.h>
+#include <linux/eventfd.h>
+#include <linux/workqueue.h>
+#include <linux/radix-tree.h>
 
 #include <asm/uaccess.h>
 #include <asm/atomic.h>
 #include <asm/cacheflush.h>
+#include <asm/system_info.h>
 #include <asm/io.h>
 
 #include <mach/dma.h>
@@ -46,20 +63,36 @@
 #define PRINTK_VERBOSE(args...)
 
 /***** TYPES ****/
-#define PAGES_PER_LIST 500
-struct PageList
+//must be powers of two
+#define DMA_RING_SUB_ENTRIES	256
+#define DMA_RING_COMP_ENTRIES	512
+#define DMA_RETIRED_ENTRIES	256
+struct VmaPageList
 {
-	struct page *m_pPages[PAGES_PER_LIST];
-	unsigned int m_used;
-	struct PageList *m_pNext;
+	//a mapping's pages, keyed by page offset into it, so faults can come in any order
+	//and any page can be found or dropped straight away, under the vma lock
+	struct radix_tree_root m_pages;
+	unsigned long m_numPages;
+	//shared by every vma split or forked from the original, under the vma lock
+	unsigned int m_refCount;
+	//the vmas using it, under the vma lock
+	struct list_head m_vmas;
+	//vmas using it which couldn't be put on the vma list, so can't be checked for overlap
+	unsigned int m_untracked;
+
+	//the mapping as it was made, offsets outside are refused
+	unsigned long m_basePgoff;
+	unsigned long m_sizePages;
+
+	//one of the DMA_MMAP_ modes and its flags, fixed when the mapping was made
+	unsigned int m_mode;
 };
 
-struct VmaPageList
+struct VmaEntry
 {
-	//each vma has a linked list of pages associated with it
-	struct PageList *m_pPageHead;
-	struct PageList *m_pPageTail;
-	unsigned int m_refCount;
+	//one of the vmas sharing a page list, so a partial unmap can tell what's still mapped
+	struct list_head m_list;
+	struct vm_area_struct *m_pVma;
 };
 
 struct DmaControlBlock
@@ -73,6 +106,221 @@ struct DmaControlBlock
 	unsigned int m_blank1, m_blank2;
 };
 
+struct DmaSharedFence
+{
+	//a fence several jobs are kicked under, which retires once they all have and the submitter has finished adding them
+	unsigned int m_fence;
+	//one for each job, and one the submitter holds until it's done
+	atomic_t m_refs;
+};
+
+struct DmaJob
+{
+	//a kicked chain, queued behind any others until the channel is free
+	struct list_head m_list;
+	//how it gets onto the channel's queue without the submitter taking the job lock
+	struct llist_node m_node;
+	unsigned int m_fence;
+	dma_addr_t m_busHead;
+
+	//where it came from, for reporting back its completion
+	unsigned int m_flags;
+	unsigned int m_userData;
+
+	//blocks taken from the kernel CB pool, given back on retirement
+	//the last of them is the chain's tail, which later jobs can be linked on to
+	unsigned int m_poolFirst;
+	unsigned int m_poolCount;
+	//or for a chain kicked from user memory, where its head is, so its blocks can be found if its progress is asked for
+	struct DmaControlBlock __user *m_pUserHead;
+	//the module's own copy of its blocks, if it has one, for the cache maintenance
+	struct DmaControlBlock *m_pKernCBs;
+	unsigned int m_kernCount;
+	//how it finished, kept while its cache maintenance is done after it
+	int m_status;
+
+	//on the hardware, either started or linked behind a job which was
+	unsigned int m_started;
+	//in jiffies, when the engine got to it at the head of the queue, so time spent behind other jobs doesn't count against it
+	unsigned long m_startTime;
+
+	struct DmaChannel *m_pChannel;
+	//who kicked it, for its completion and waiting on all of a file's work
+	struct DmaContext *m_pCtx;
+	//if it's one of several under the same fence
+	struct DmaSharedFence *m_pShared;
+};
+
+struct DmaChannel
+{
+	//one of the hardware channels we own, and the chains queued on it
+	unsigned int *m_pBase;
+	int m_irq;
+	int m_chan;
+
+	//the head is the one running
+	struct list_head m_jobQueue;
+	atomic_t m_queued;
+
+	//pushed by submitters, moved onto the job queue by whoever holds the job lock
+	struct llist_head m_incoming;
+};
+
+//submission ring entry, filled in by user space
+struct DmaSubmission
+{
+	struct DmaControlBlock __user *m_pCB;
+	unsigned int m_flags;
+	unsigned int m_userData;
+};
+
+//completion ring entry, filled in by the module
+struct DmaCompletion
+{
+	unsigned int m_userData;
+	unsigned int m_fence;
+	int m_status;
+	unsigned int m_pad;
+	unsigned long long m_timestampNs;
+};
+
+//passed to DMA_CHAIN_UPDATE, re-prepares CBs [m_first, m_first + m_count) of a registered chain
+struct DmaChainUpdate
+{
+	unsigned long m_id;
+	unsigned int m_first;
+	unsigned int m_count;
+};
+
+struct DmaChain
+{
+	//a translated copy of a user chain, kept by the module so it can be kicked again and again
+	unsigned int m_numCBs;
+	struct DmaControlBlock *m_pCBs;
+	dma_addr_t m_busCBs;
+	//where each block came from, for re-preparing
+	struct DmaControlBlock __user **m_ppUserCBs;
+	//the last kick, so it's not changed underneath a running chain
+	unsigned int m_lastFence;
+	//every kick goes to the same channel, so one can't overtake another
+	struct DmaChannel *m_pChannel;
+	//while cycling, the channel it has to itself, as it never finishes
+	unsigned int *m_pCycleBase;
+	int m_cycleChan;
+	int m_cycleIrq;
+	//the pages each block reads and writes, two per block, so they stay put between kicks
+	struct DmaFixedBuffer **m_ppPins;
+	struct DmaFixedBuffer *m_pOldPins;
+};
+
+//a transfer to be written into a kernel-owned CB, with user addresses
+struct DmaDescriptor
+{
+	unsigned int m_transferInfo;
+	void __user *m_pSourceAddr;
+	void __user *m_pDestAddr;
+	unsigned int m_xferLen;
+	unsigned int m_tdStride;
+};
+
+//passed to DMA_SUBMIT_DESCRIPTORS
+struct DmaDescriptorList
+{
+	struct DmaDescriptor __user *m_pDescriptors;
+	unsigned int m_count;
+};
+
+//a linear copy of any size and alignment, split up by the module wherever the memory is not physically contiguous
+struct DmaCopy
+{
+	void __user *m_pSourceAddr;
+	void __user *m_pDestAddr;
+	unsigned int m_length;
+	unsigned int m_flags;
+};
+
+//passed to DMA_SUBMIT_COPIES
+struct DmaCopyList
+{
+	struct DmaCopy __user *m_pCopies;
+	unsigned int m_count;
+};
+
+//passed to DMA_PREPARE_ARRAY, CBs laid out one after another in user memory
+struct DmaPrepareArray
+{
+	struct DmaControlBlock __user *m_pCBs;
+	unsigned int m_count;
+};
+
+//passed to DMA_GET_PROGRESS, user space fills in the fence and the module the rest
+//only jobs still queued are counted, so with a shared fence the ones which have retired drop out
+struct DmaProgress
+{
+	unsigned int m_fence;
+	//every job with the fence has retired
+	unsigned int m_done;
+	//over the CBs the module owns, or those of a user chain kicked from within the last DMA_PREPARE_ARRAY
+	unsigned int m_cbsDone;
+	unsigned int m_cbsTotal;
+	unsigned int m_bytesDone;
+	//the CB the engine is on, which user space can match against its own m_pNext fields, or zero
+	unsigned int m_busCB;
+};
+
+//one cached user range to clean and/or invalidate
+struct DmaCacheRange
+{
+	void __user *m_pAddr;
+	unsigned int m_length;
+};
+
+//passed to DMA_CACHE_OP, with m_op made up of the DMA_CACHE_ flags
+struct DmaCacheRangeList
+{
+	struct DmaCacheRange __user *m_pRanges;
+	unsigned int m_count;
+	unsigned int m_op;
+};
+
+//passed to DMA_REGISTER_BUFFER
+struct DmaBufferRegistration
+{
+	void __user *m_pAddr;
+	unsigned long m_length;
+};
+
+struct DmaFixedBuffer
+{
+	//a user range pinned in memory and translated up front
+	unsigned long m_start, m_end;
+	struct mm_struct *m_pMm;
+	unsigned int m_numPages;
+	struct page **m_ppPages;
+	unsigned long *m_pBusPages;
+	//whether the dma may write to it
+	int m_write;
+	//a cycling chain's pins which the engine may still be using, kept until it's seen off the block that had them
+	struct DmaFixedBuffer *m_pNext;
+	unsigned int m_oldBlock;
+};
+
+//both rings live in one block that user space maps through DMA_RING_MMAP_OFFSET
+//indices are free-running and wrapped by the ring size
+struct DmaRings
+{
+	//user space writes at the submission tail, the module consumes from the head
+	unsigned int m_subHead, m_subTail;
+	//the module writes at the completion tail, user space consumes from the head
+	unsigned int m_compHead, m_compTail;
+	//completions that were thrown away as the ring was full
+	unsigned int m_compOverflow;
+	unsigned int m_pad[3];
+
+	struct DmaSubmission m_sub[DMA_RING_SUB_ENTRIES];
+	struct DmaCompletion m_comp[DMA_RING_COMP_ENTRIES];
+};
+
 /***** DEFINES ******/
 //magic number defining the module
 #define DMA_MAGIC		0xdd
@@ -89,8 +337,8 @@ struct DmaControlBlock
 //prepare it, kick it, don't wait for it
 #define DMA_PREPARE_KICK	_IOWR(DMA_MAGIC, 3, struct DmaControlBlock *)
 
-//not currently implemented
-#define DMA_WAIT_ONE		_IO(DMA_MAGIC, 4, struct DmaControlBlock *)
+//wait on a single kicked CB chain, identified by the fence returned from the kick
+#define DMA_WAIT_ONE		_IOW(DMA_MAGIC, 4, unsigned long)
 
 //wait on all kicked CB chains
 #define DMA_WAIT_ALL		_IO(DMA_MAGIC, 5)
@@ -106,29 +354,301 @@ struct DmaControlBlock
 //used to define the size for the CMA-based allocation *in pages*, can only be done once once the file is opened
 #define DMA_CMA_SET_SIZE	_IOW(DMA_MAGIC, 10, unsigned long)
 
+//consume everything posted to the submission ring, returning the number of entries taken
+#define DMA_RING_ENTER		_IO(DMA_MAGIC, 11)
+
+//pin a user range and translate it once, returning a handle for unregistering it
+//CBs then use ordinary user pointers into the range, which no longer need translating
+#define DMA_REGISTER_BUFFER	_IOW(DMA_MAGIC, 12, struct DmaBufferRegistration *)
+#define DMA_UNREGISTER_BUFFER	_IOW(DMA_MAGIC, 13, unsigned long)
+
+//take a copy of an unprepared user chain and translate it, returning an id for kicking it
+//the user chain is left alone, and its shape is fixed from here on
+#define DMA_CHAIN_REGISTER	_IOW(DMA_MAGIC, 14, struct DmaControlBlock *)
+//kick a registered chain by id, returning a fence
+#define DMA_CHAIN_KICK		_IOW(DMA_MAGIC, 15, unsigned long)
+//re-read and translate a range of a registered chain's CBs from where they were in user space
+#define DMA_CHAIN_UPDATE	_IOW(DMA_MAGIC, 16, struct DmaChainUpdate *)
+#define DMA_CHAIN_UNREGISTER	_IOW(DMA_MAGIC, 17, unsigned long)
+
+//translate an array of descriptors into CBs owned by the module and kick them as one chain, returning a fence
+//user space needs no CBs of its own, nor to care where they live
+#define DMA_SUBMIT_DESCRIPTORS	_IOW(DMA_MAGIC, 18, struct DmaDescriptorList *)
+
+//as DMA_PREPARE, for CBs in a contiguous user array rather than wherever m_pNext points
+//they are copied in and out in large chunks and flushed once, then kicked with DMA_KICK on the first
+#define DMA_PREPARE_ARRAY	_IOW(DMA_MAGIC, 19, struct DmaPrepareArray *)
+
+//copy between user ranges of any size, the module builds the CBs, returning a fence
+//large lists are kicked in several pieces, all sharing the one fence
+//every range is translated before any of it is kicked, and if it still fails part way what was kicked has finished
+#define DMA_SUBMIT_COPIES	_IOW(DMA_MAGIC, 20, struct DmaCopyList *)
+
+//run a registered chain round and round on a channel of its own, with its last CB leading back to its first
+//it can't be kicked while cycling, but it can be updated, taking care to stay clear of where the engine is
+#define DMA_CHAIN_CYCLE		_IOW(DMA_MAGIC, 21, unsigned long)
+//the index of the CB a cycling chain is on, for knowing how far round it has got
+#define DMA_CHAIN_POSITION	_IOW(DMA_MAGIC, 22, unsigned long)
+#define DMA_CHAIN_STOP		_IOW(DMA_MAGIC, 23, unsigned long)
+
+//how far through its chain the job with a given fence has got, so the front of a transfer can be used early
+#define DMA_GET_PROGRESS	_IOWR(DMA_MAGIC, 24, struct DmaProgress *)
+
+//signal an eventfd each time one of this file's fences retires, or stop with a negative fd
+//read() gives back the fences themselves, and poll() and SIGIO say when there are some
+#define DMA_SET_EVENTFD		_IOW(DMA_MAGIC, 25, int)
+
+//clean and/or invalidate the data cache over a list of user ranges, before or after a dma touches them
+#define DMA_CACHE_OP		_IOW(DMA_MAGIC, 26, struct DmaCacheRangeList *)
+//non-zero to have every job kicked from then on clean its sources and clean+invalidate its destinations first
+//the arm1176 doesn't speculatively fill, but on v7 cores the destinations are done again before its fence retires
+#define DMA_SET_AUTO_CACHE	_IOW(DMA_MAGIC, 27, unsigned long)
+
+//how later mmaps of buffer memory are mapped, one of the DMA_MMAP_ modes and its flags, until it's set again
+//write-combined and uncached buffers need no cache maintenance at all
+#define DMA_SET_MMAP_MODE	_IOW(DMA_MAGIC, 28, unsigned long)
+
 //used to get the version of the module, to test for a capability
 #define DMA_GET_VERSION		_IO(DMA_MAGIC, 99)
 
-#define VERSION_NUMBER 1
+#define VERSION_NUMBER 16
+
+//mmap offset through which the submission/completion rings are mapped
+#define DMA_RING_MMAP_OFFSET	0x40000000
+
+//submission flags: translate the chain before kicking it
+#define DMA_SUBMIT_PREPARE	(1 << 0)
+
+//job flags: report the completion through the ring
+#define DMA_JOB_RING		(1 << 0)
+//throw away what the cpu pulled into the cache of the destinations while it ran, before it retires
+#define DMA_JOB_AUTO_CACHE	(1 << 1)
+
+//cache op flags: write back dirty lines so the dma sees them
+#define DMA_CACHE_CLEAN		(1 << 0)
+//throw lines away so the cpu sees what the dma wrote
+#define DMA_CACHE_INVALIDATE	(1 << 1)
+#define DMA_CACHE_FLUSH		(DMA_CACHE_CLEAN | DMA_CACHE_INVALIDATE)
+
+//mmap modes: ordinary cached memory, the default
+#define DMA_MMAP_CACHED		0
+//writes are buffered and merged, reads are slow, for buffers the cpu only produces
+#define DMA_MMAP_WRITECOMBINE	1
+//strongly ordered, for buffers only the dma touches
+#define DMA_MMAP_UNCACHED	2
+#define DMA_MMAP_CACHE_MASK	0xff
+//mmap flags: back the whole mapping at mmap time with blocks as physically contiguous as can be found
+//so one CB can cover many pages
+#define DMA_MMAP_CONTIGUOUS	(1 << 8)
+//fill the whole mapping and put it all in the page tables at mmap time, so it never faults
+//otherwise pages are filled and mapped one fault at a time, so a sparsely touched mapping only costs what it touches
+//it's filled as with DMA_MMAP_CONTIGUOUS, as that's the quickest way to get a lot of pages
+#define DMA_MMAP_POPULATE	(1 << 9)
+
+//copy flags: read the same source bytes over and over, to fill the destination
+#define DMA_COPY_SRC_FIXED	(1 << 0)
+//split the copy across every channel, each taking a share in proportion to its burst length
+//striped copies aren't ordered against the other copies in the list
+#define DMA_COPY_STRIPE		(1 << 1)
+#define DMA_COPY_FLAGS		(DMA_COPY_SRC_FIXED | DMA_COPY_STRIPE)
+
+#define DMA_MAX_FIXED_BUFFERS 64
+
+#define DMA_MAX_CHAINS 64
+#define DMA_MAX_CHAIN_CBS 65536
+
+//kernel-owned CBs, in one coherent block - 128k
+#define DMA_CB_POOL_SIZE	4096
+//descriptors copied in from user space at a time
+#define DMA_DESC_CHUNK		64
+//CBs copied in and out by DMA_PREPARE_ARRAY at a time - one page
+#define DMA_PREPARE_CHUNK	128
+//cache ranges read in one go
+#define DMA_CACHE_CHUNK		64
+//above this, working through the cache line by line is slower than flushing the lot
+#define DMA_CACHE_ALL_BYTES	(32 * 1024)
+//user pages pinned at a time while their cache lines are worked on
+#define DMA_CACHE_PIN_BATCH	16
+
+//the largest block tried for a contiguous mapping, 4MB, MAX_ORDER - 1 on the pi
+#define DMA_CONTIG_MAX_ORDER	10
+
+//pages taken out of a mapping's tree per lookup when tearing it down
+#define DMA_FREE_BATCH		16
+//copies in a single DMA_SUBMIT_COPIES
+#define DMA_MAX_COPIES		1024
+//CBs built from copies before they are kicked as a job
+#define DMA_COPY_BATCH		512
+//largest length a single CB can take, lite channels only have 16 bits of length
+#define DMA_MAX_XFER_LEN	0x3fffffff
+#define DMA_MAX_XFER_LEN_LITE	0xffff
+#define DMA_FIRST_LITE_CHANNEL	7
+
+//most channels we will take from the system
+#define DMA_MAX_CHANNELS	8
+
+#define VIRT_TO_BUS_CACHE_BITS 12
+#define VIRT_TO_BUS_CACHE_SIZE (1 << VIRT_TO_BUS_CACHE_BITS)
+
+//dma channel registers, as word offsets from the channel base
+#define DMA_REG_CS		0
+#define DMA_REG_CONBLK_AD	1
+#define DMA_REG_TI		2
+#define DMA_REG_SOURCE_AD	3
+#define DMA_REG_DEST_AD		4
+#define DMA_REG_TXFR_LEN	5
+#define DMA_REG_STRIDE		6
+#define DMA_REG_NEXTCONBK	7
+#define DMA_REG_DEBUG		8
+
+//control/status register bits
+#define DMA_CS_ACTIVE		(1 << 0)
+#define DMA_CS_END		(1 << 1)
+#define DMA_CS_INT		(1 << 2)
+#define DMA_CS_RESET		(1 << 31)
+
+//transfer information bits
+#define DMA_TI_INTEN		(1 << 0)
+#define DMA_TI_TDMODE		(1 << 1)
+#define DMA_TI_DEST_INC		(1 << 4)
+#define DMA_TI_DEST_WIDTH	(1 << 5)
+#define DMA_TI_SRC_INC		(1 << 8)
+#define DMA_TI_SRC_WIDTH	(1 << 9)
+#define DMA_TI_BURST(x)		((x) << 12)
+
+//how many times to poll the channel before going to sleep on the interrupt
+#define DMA_WAIT_SPIN_COUNT	100
+//how long to sleep between re-checks, in case a chain finishes without raising an interrupt
+#define DMA_WAIT_SLICE_MS	10
+//give up waiting after this long
+#define DMA_WAIT_TIMEOUT_MS	1000
+//someone else's job holding up a waiter is thrown away after this long
+#define DMA_HOG_TIMEOUT_MS	(10 * DMA_WAIT_TIMEOUT_MS)
+
+//fences are handed back through the ioctl return value so must stay positive
+#define DMA_FENCE_MASK		0x7fffffff
+
+/***** CONTEXT *****/
+struct DmaAddrCache
+{
+	//one cpu's cache of a context's translations, hashed by virtual page
+	unsigned long m_virtAddr[VIRT_TO_BUS_CACHE_SIZE];
+	unsigned long m_busAddr[VIRT_TO_BUS_CACHE_SIZE];
+	unsigned long m_cbVirtAddr;
+	unsigned long m_cbBusAddr;
+	int m_cacheHit, m_cacheMiss;
+	//only ever contended by invalidations
+	spinlock_t m_lock;
+};
+
+struct DmaContext
+{
+	//everything belonging to one open of the device, so several clients can use it at once
+	//the channels, their job queues and the CB pool are shared by all
+
+	//off by default
+	void __user *m_pMinPhys;
+	void __user *m_pMaxPhys;
+	unsigned long m_physOffset;
+
+	//cma allocation
+	int m_cmaHandle;
+
+	//submission/completion rings, allocated on first mmap
+	struct DmaRings *m_pRings;
+
+	//user virtual to bus address translation acceleration, one per cpu so threads don't fight over it
+	//only valid for the process that opened the file
+	//each is far bigger than a per-cpu allocation can be, so only the pointers are per-cpu
+	struct DmaAddrCache * __percpu *m_ppCaches;
+	//bumped on every invalidation, so a translation which raced with one is not inserted
+	atomic_t m_addrCacheGen;
+	struct mm_struct *m_pMm;
+
+#ifdef CONFIG_MMU_NOTIFIER
+	//tells us when the process's page tables change, so the cache can live across ioctls
+	struct mmu_notifier m_mmuNotifier;
+#endif
+
+	//registered chains, the id is the index plus one
+	struct DmaChain *m_pChains[DMA_MAX_CHAINS];
+	struct mutex m_chainLock;
+
+	//registered buffers, the handle is the index plus one
+	//looked up far more often than they change
+	struct DmaFixedBuffer *m_pFixedBuffers[DMA_MAX_FIXED_BUFFERS];
+	atomic_t m_numFixed;
+	atomic_t m_lastFixedBuffer;
+	rwlock_t m_fixedLock;
+
+	//one thread at a time consumes the submission ring
+	struct mutex m_ringLock;
+
+	//do the cache maintenance for jobs as they are kicked
+	int m_autoCache;
+
+	//the last array prepared, so chains kicked from within it can report their progress
+	struct DmaControlBlock __user *m_pArrayCBs;
+	unsigned int m_arrayCount;
 
-#define VIRT_TO_BUS_CACHE_SIZE 8
+	//how the next buffer mmap is mapped
+	unsigned int m_mmapMode;
+
+	//jobs kicked through this file which have not retired
+	atomic_t m_queued;
+
+	//fences which have retired, waiting to be read, under the job lock
+	unsigned int m_retired[DMA_RETIRED_ENTRIES];
+	unsigned int m_retiredHead, m_retiredTail;
+	unsigned int m_retiredOverflow;
+	wait_queue_head_t m_retiredWait;
+
+	//other ways of being told, also under the job lock
+	struct fasync_struct *m_pFasync;
+	struct eventfd_ctx *m_pEventFd;
+};
 
 /***** FILE OPS *****/
 static int Open(struct inode *pInode, struct file *pFile);
 static int Release(struct inode *pInode, struct file *pFile);
 static long Ioctl(struct file *pFile, unsigned int cmd, unsigned long arg);
 static ssize_t Read(struct file *pFile, char __user *pUser, size_t count, loff_t *offp);
+static unsigned int Poll(struct file *pFile, poll_table *pWait);
+static int Fasync(int fd, struct file *pFile, int on);
 static int Mmap(struct file *pFile, struct vm_area_struct *pVma);
 
 /***** VMA OPS ****/
 static void VmaOpen4k(struct vm_area_struct *pVma);
 static void VmaClose4k(struct vm_area_struct *pVma);
 static int VmaFault4k(struct vm_area_struct *pVma, struct vm_fault *pVmf);
+static int VmaFreeRange(struct VmaPageList *pVmaList, unsigned long first, unsigned long end);
+static int VmaFillContiguous(struct VmaPageList *pVmaList, unsigned long numPages);
+static int VmaInsertAll(struct vm_area_struct *pVma, struct VmaPageList *pVmaList);
 
 /**** DMA PROTOTYPES */
-static struct DmaControlBlock __user *DmaPrepare(struct DmaControlBlock __user *pUserCB, int *pError);
-static int DmaKick(struct DmaControlBlock __user *pUserCB);
-static void DmaWaitAll(void);
+static struct DmaControlBlock __user *DmaPrepare(struct DmaContext *pCtx, struct DmaControlBlock __user *pUserCB, int *pError);
+static int DmaPrepareChain(struct DmaContext *pCtx, struct DmaControlBlock __user *pUserCB);
+static int DmaPrepareArray(struct DmaContext *pCtx, struct DmaPrepareArray __user *pUserArray);
+static int DmaTranslateCB(struct DmaContext *pCtx, struct DmaControlBlock *pCB);
+static int DmaQueueJob(struct DmaContext *pCtx, dma_addr_t busHead, unsigned int jobFlags, unsigned int userData,
+		unsigned int poolFirst, unsigned int poolCount, struct DmaControlBlock __user *pUserHead, struct DmaChannel **ppChannel,
+		struct DmaSharedFence *pShared, unsigned int *pFence);
+static int DmaKick(struct DmaContext *pCtx, struct DmaControlBlock __user *pUserCB, unsigned int jobFlags, unsigned int userData, unsigned int *pFence);
+static int ChainUnregister(struct DmaContext *pCtx, unsigned long id);
+static int ChainCycle(struct DmaContext *pCtx, unsigned long id);
+static int ChainPosition(struct DmaContext *pCtx, unsigned long id);
+static int ChainStop(struct DmaContext *pCtx, unsigned long id);
+static int DmaSubmitDescriptors(struct DmaContext *pCtx, struct DmaDescriptorList __user *pUserList);
+static int DmaSubmitCopies(struct DmaContext *pCtx, struct DmaCopyList __user *pUserList);
+static int DmaRingEnter(struct DmaContext *pCtx);
+static int DmaWait(struct DmaContext *pCtx, unsigned int fence);
+static void DmaWaitAll(struct DmaContext *pCtx);
+static int DmaGetProgress(struct DmaContext *pCtx, struct DmaProgress __user *pUserProgress);
+static int DmaCacheOp(struct DmaContext *pCtx, struct DmaCacheRangeList __user *pUserList);
+static void DmaAbortCtx(struct DmaContext *pCtx);
+static void DmaAbortHogs(void);
+static struct DmaControlBlock *DmaJobCBs(struct DmaJob *pJob, unsigned int *pCount);
+static irqreturn_t DmaIrq(int irq, void *pDevId);
 
 /**** GENERIC ****/
 static int __init dmaer_init(void);
@@ -146,6 +666,8 @@ static struct file_operations g_fOps = {
 	.llseek = 0,
 	.read = Read,
 	.write = 0,
+	.poll = Poll,
+	.fasync = Fasync,
 	.unlocked_ioctl = Ioctl,
 	.open = Open,
 	.release = Release,
@@ -155,44 +677,223 @@ static struct file_operations g_fOps = {
 /***** GLOBALS ******/
 static dev_t g_majorMinor;
 
-//tracking usage of the two files
-static atomic_t g_oneLock4k = ATOMIC_INIT(1);
-
 //device operations
 static struct cdev g_cDev;
 static int g_trackedPages = 0;
 
+//protects the page lists' trees and vma lists
+static DEFINE_SPINLOCK(g_vmaLock);
+
 //dma control
-static unsigned int *g_pDmaChanBase;
-static int g_dmaIrq;
-static int g_dmaChan;
-
-//cma allocation
-static int g_cmaHandle;
-
-//user virtual to bus address translation acceleration
-static unsigned long g_virtAddr[VIRT_TO_BUS_CACHE_SIZE];
-static unsigned long g_busAddr[VIRT_TO_BUS_CACHE_SIZE];
-static unsigned long g_cbVirtAddr;
-static unsigned long g_cbBusAddr;
-static int g_cacheInsertAt;
-static int g_cacheHit, g_cacheMiss;
-
-//off by default
-static void __user *g_pMinPhys;
-static void __user *g_pMaxPhys;
-static unsigned long g_physOffset;
+static struct DmaChannel g_channels[DMA_MAX_CHANNELS];
+static int g_numChannels;
+
+//how many channels to ask for at load time
+static int g_wantChannels = 1;
+module_param_named(channels, g_wantChannels, int, S_IRUGO);
+MODULE_PARM_DESC(channels, "number of dma channels to spread chains across");
+
+//pages from unmapped buffers, kept for the next mapping rather than going back to the page allocator
+//dirty ones still hold whatever the last user left and are zeroed in the background
+static LIST_HEAD(g_poolDirty);
+static LIST_HEAD(g_poolClean);
+static unsigned int g_poolPages;
+static DEFINE_SPINLOCK(g_poolLock);
+
+static unsigned int g_poolCap = 1024;
+module_param_named(pool_pages, g_poolCap, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(pool_pages, "most freed buffer pages to keep for reuse");
+
+static void PagePoolZero(struct work_struct *pWork);
+static DECLARE_WORK(g_poolZeroWork, PagePoolZero);
+
+//threads waiting for chains to retire sleep here
+static DECLARE_WAIT_QUEUE_HEAD(g_dmaWaitQueue);
+
+//protects every channel's job queue and registers, fences are shared between them
+static DEFINE_SPINLOCK(g_jobLock);
+static atomic_t g_fenceIssued = ATOMIC_INIT(0);
+
+//jobs the engine has finished with, which retire once their cache maintenance is done, also under the job lock
+static LIST_HEAD(g_autoCacheJobs);
+static DEFINE_MUTEX(g_autoCacheLock);
+static void DmaAutoCacheWork(struct work_struct *pWork);
+static DECLARE_WORK(g_autoCacheWork, DmaAutoCacheWork);
+
+//coherent CBs written by the module, no cache maintenance needed
+//handed out in runs under the pool lock, which nests inside the job lock
+static struct DmaControlBlock *g_pCbPool;
+static dma_addr_t g_busCbPool;
+static unsigned long g_cbPoolMap[BITS_TO_LONGS(DMA_CB_POOL_SIZE)];
+static DEFINE_SPINLOCK(g_cbPoolLock);
 
 /****** CACHE OPERATIONS ********/
-static inline void FlushAddrCache(void)
+static inline struct DmaAddrCache *AddrCache(struct DmaContext *pCtx, int cpu)
+{
+	return *per_cpu_ptr(pCtx->m_ppCaches, cpu);
+}
+
+static void FreeAddrCaches(struct DmaContext *pCtx)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		vfree(AddrCache(pCtx, cpu));
+
+	free_percpu(pCtx->m_ppCaches);
+}
+
+//returns non-zero if out of memory, with anything allocated already freed
+static int AllocAddrCaches(struct DmaContext *pCtx)
+{
+	struct DmaAddrCache *pCache;
+	int cpu;
+
+	pCtx->m_ppCaches = alloc_percpu(struct DmaAddrCache *);
+	if (!pCtx->m_ppCaches)
+		return 1;
+
+	for_each_possible_cpu(cpu)
+	{
+		pCache = (struct DmaAddrCache *)vmalloc(sizeof(struct DmaAddrCache));
+		if (!pCache)
+		{
+			FreeAddrCaches(pCtx);
+			return 1;
+		}
+
+		spin_lock_init(&pCache->m_lock);
+		pCache->m_cacheHit = pCache->m_cacheMiss = 0;
+		*per_cpu_ptr(pCtx->m_ppCaches, cpu) = pCache;
+	}
+
+	return 0;
+}
+
+static inline unsigned int AddrCacheSlot(unsigned long virtual_page)
+{
+	return hash_long(virtual_page >> PAGE_SHIFT, VIRT_TO_BUS_CACHE_BITS);
+}
+
+static inline void FlushAddrCache(struct DmaContext *pCtx)
+{
+	int count, cpu;
+
+	//anything being looked up right now mustn't be inserted
+	atomic_inc(&pCtx->m_addrCacheGen);
+
+	for_each_possible_cpu(cpu)
+	{
+		struct DmaAddrCache *pCache = AddrCache(pCtx, cpu);
+
+		spin_lock(&pCache->m_lock);
+
+		for (count = 0; count < VIRT_TO_BUS_CACHE_SIZE; count++)
+			pCache->m_virtAddr[count] = 0xffffffff;			//never going to match as we always chop the bottom bits anyway
+
+		pCache->m_cbVirtAddr = 0xffffffff;
+
+		spin_unlock(&pCache->m_lock);
+	}
+}
+
+//drop any cached translations for user pages in [start, end)
+static void InvalidateAddrCache(struct DmaContext *pCtx, unsigned long start, unsigned long end)
+{
+	unsigned long virtual_page;
+	int cpu;
+
+	//quicker to throw it all away than to walk a big range
+	if ((end - start) >> PAGE_SHIFT >= VIRT_TO_BUS_CACHE_SIZE)
+	{
+		FlushAddrCache(pCtx);
+		return;
+	}
+
+	atomic_inc(&pCtx->m_addrCacheGen);
+
+	for_each_possible_cpu(cpu)
+	{
+		struct DmaAddrCache *pCache = AddrCache(pCtx, cpu);
+
+		spin_lock(&pCache->m_lock);
+
+		for (virtual_page = start & ~4095; virtual_page < end; virtual_page += 4096)
+		{
+			unsigned int slot = AddrCacheSlot(virtual_page);
+
+			if (pCache->m_virtAddr[slot] == virtual_page)
+				pCache->m_virtAddr[slot] = 0xffffffff;
+
+			if (pCache->m_cbVirtAddr == virtual_page)
+				pCache->m_cbVirtAddr = 0xffffffff;
+		}
+
+		spin_unlock(&pCache->m_lock);
+	}
+}
+
+#ifdef CONFIG_MMU_NOTIFIER
+static void MmuInvalidatePage(struct mmu_notifier *pMn, struct mm_struct *pMm, unsigned long address)
+{
+	struct DmaContext *pCtx = container_of(pMn, struct DmaContext, m_mmuNotifier);
+
+	InvalidateAddrCache(pCtx, address, address + 1);
+}
+
+static void MmuInvalidateRangeStart(struct mmu_notifier *pMn, struct mm_struct *pMm,
+	unsigned long start, unsigned long end)
+{
+	struct DmaContext *pCtx = container_of(pMn, struct DmaContext, m_mmuNotifier);
+
+	InvalidateAddrCache(pCtx, start, end);
+}
+
+static void MmuRelease(struct mmu_notifier *pMn, struct mm_struct *pMm)
+{
+	struct DmaContext *pCtx = container_of(pMn, struct DmaContext, m_mmuNotifier);
+
+	FlushAddrCache(pCtx);
+}
+
+static const struct mmu_notifier_ops g_mmuOps = {
+	.release = MmuRelease,
+	.invalidate_page = MmuInvalidatePage,
+	.invalidate_range_start = MmuInvalidateRangeStart,
+};
+#endif
+
+//find the page at a given offset into one of our mappings, must be called with the vma lock or rcu read lock held
+static inline struct page *VmaLookupPage(struct VmaPageList *pVmaList, unsigned long pgoff)
+{
+	if (!pVmaList || pgoff < pVmaList->m_basePgoff || pgoff - pVmaList->m_basePgoff >= pVmaList->m_sizePages)
+		return 0;
+
+	return (struct page *)radix_tree_lookup(&pVmaList->m_pages, pgoff - pVmaList->m_basePgoff);
+}
+
+//translate an address inside one of our own mappings using the pages handed out at fault time
+//must be called with mmap_sem held, returns zero if it's not ours or the page has not been faulted in yet
+static inline void __iomem *UserVirtualToBusViaVma(void __user *pUser)
 {
-	int count = 0;
-	for (count = 0; count < VIRT_TO_BUS_CACHE_SIZE; count++)
-		g_virtAddr[count] = 0xffffffff;			//never going to match as we always chop the bottom bits anyway
+	struct vm_area_struct *pVma;
+	struct page *pPage;
+	unsigned long addr = (unsigned long)pUser;
+	void __iomem *pBus = 0;
+
+	pVma = find_vma(current->mm, addr);
+	if (!pVma || addr < pVma->vm_start || pVma->vm_ops != &g_vmOps4k || !pVma->vm_private_data)
+		return 0;
 
-	g_cbVirtAddr = 0xffffffff;
+	//faults may be filing pages alongside, the tree is safe to read under rcu
+	rcu_read_lock();
+	pPage = VmaLookupPage((struct VmaPageList *)pVma->vm_private_data,
+		pVma->vm_pgoff + ((addr - pVma->vm_start) >> PAGE_SHIFT));
+	if (pPage)
+		pBus = (void __iomem *)__virt_to_bus(page_address(pPage) + offset_in_page(pUser));
+	rcu_read_unlock();
 
-	g_cacheInsertAt = 0;
+	return pBus;
 }
 
 //translate from a user virtual address to a bus address by mapping the page
@@ -202,6 +903,17 @@ static inline void __iomem *UserVirtualToBus(void __user *pUser)
 	int mapped;
 	struct page *pPage;
 	void *phys;
+	void __iomem *pBus;
+
+	down_read(&current->mm->mmap_sem);
+
+	//our own pages can be found without get_user_pages
+	pBus = UserVirtualToBusViaVma(pUser);
+	if (pBus)
+	{
+		up_read(&current->mm->mmap_sem);
+		return pBus;
+	}
 
 	//map it (requiring that the pointer points to something that does not hang off the page boundary)
 	mapped = get_user_pages(current, current->mm,
@@ -209,6 +921,7 @@ static inline void __iomem *UserVirtualToBus(void __user *pUser)
 		1, 0,
 		&pPage,
 		0);
+	up_read(&current->mm->mmap_sem);
 
 	if (mapped <= 0)		//error
 		return 0;
@@ -224,172 +937,671 @@ static inline void __iomem *UserVirtualToBus(void __user *pUser)
 	return (void __iomem *)__virt_to_bus(phys);
 }
 
-static inline void __iomem *UserVirtualToBusViaCbCache(void __user *pUser)
+//look the address up in the registered buffers, returning zero if it's not in one
+static inline void __iomem *UserVirtualToBusViaFixed(struct DmaContext *pCtx, void __user *pUser)
+{
+	unsigned long addr = (unsigned long)pUser;
+	struct DmaFixedBuffer *pBuffer;
+	void __iomem *pBus = 0;
+	int count, last, index = 0;
+
+	//most contexts never register one, and shouldn't pay for the lock
+	if (!atomic_read(&pCtx->m_numFixed))
+		return 0;
+
+	last = atomic_read(&pCtx->m_lastFixedBuffer);
+
+	read_lock(&pCtx->m_fixedLock);
+
+	//most lookups hit the same buffer as the last one
+	for (count = 0; count < DMA_MAX_FIXED_BUFFERS; count++)
+	{
+		index = (last + count) % DMA_MAX_FIXED_BUFFERS;
+		pBuffer = pCtx->m_pFixedBuffers[index];
+
+		if (pBuffer && pBuffer->m_pMm == current->mm && addr >= pBuffer->m_start && addr < pBuffer->m_end)
+		{
+			unsigned long page = (addr - (pBuffer->m_start & ~4095)) >> PAGE_SHIFT;
+			pBus = (void __iomem *)(pBuffer->m_pBusPages[page] + (addr & 4095));
+			break;
+		}
+	}
+
+	read_unlock(&pCtx->m_fixedLock);
+
+	//only a hint, so whichever lookup gets there last wins
+	if (pBus && index != last)
+		atomic_set(&pCtx->m_lastFixedBuffer, index);
+
+	return pBus;
+}
+
+static inline void __iomem *UserVirtualToBusViaCbCache(struct DmaContext *pCtx, void __user *pUser)
 {
 	unsigned long virtual_page = (unsigned long)pUser & ~4095;
 	unsigned long page_offset = (unsigned long)pUser & 4095;
 	unsigned long bus_addr;
+	unsigned int gen;
+	struct DmaAddrCache *pCache;
+	void __iomem *pBus;
+
+	//pinned and translated already
+	pBus = UserVirtualToBusViaFixed(pCtx, pUser);
+	if (pBus)
+		return pBus;
+
+	//the cache only describes the opener's address space
+	if (current->mm != pCtx->m_pMm)
+		return UserVirtualToBus(pUser);
 
-	if (g_cbVirtAddr == virtual_page)
+	pCache = AddrCache(pCtx, get_cpu());
+	spin_lock(&pCache->m_lock);
+
+	if (pCache->m_cbVirtAddr == virtual_page)
 	{
-		bus_addr = g_cbBusAddr + page_offset;
-		g_cacheHit++;
+		bus_addr = pCache->m_cbBusAddr + page_offset;
+		pCache->m_cacheHit++;
+		spin_unlock(&pCache->m_lock);
+		put_cpu();
 		return (void __iomem *)bus_addr;
 	}
-	else
-	{
-		bus_addr = (unsigned long)UserVirtualToBus(pUser);
-		
-		if (!bus_addr)
-			return 0;
-		
-		g_cbVirtAddr = virtual_page;
-		g_cbBusAddr = bus_addr & ~4095;
-		g_cacheMiss++;
 
-		return (void __iomem *)bus_addr;
+	spin_unlock(&pCache->m_lock);
+	put_cpu();
+
+	//the lookup can sleep, so it's done away from the cpu's cache
+	gen = atomic_read(&pCtx->m_addrCacheGen);
+	bus_addr = (unsigned long)UserVirtualToBus(pUser);
+	
+	if (!bus_addr)
+		return 0;
+	
+	//we may have moved cpu in the meantime, which doesn't matter
+	pCache = AddrCache(pCtx, get_cpu());
+	spin_lock(&pCache->m_lock);
+	if (gen == atomic_read(&pCtx->m_addrCacheGen))
+	{
+		pCache->m_cbVirtAddr = virtual_page;
+		pCache->m_cbBusAddr = bus_addr & ~4095;
 	}
+	pCache->m_cacheMiss++;
+	spin_unlock(&pCache->m_lock);
+	put_cpu();
+
+	return (void __iomem *)bus_addr;
 }
 
 //do the same as above, by query our virt->bus cache
-static inline void __iomem *UserVirtualToBusViaCache(void __user *pUser)
+static inline void __iomem *UserVirtualToBusViaCache(struct DmaContext *pCtx, void __user *pUser)
 {
-	int count;
 	//get the page and its offset
 	unsigned long virtual_page = (unsigned long)pUser & ~4095;
 	unsigned long page_offset = (unsigned long)pUser & 4095;
 	unsigned long bus_addr;
+	unsigned int slot = AddrCacheSlot(virtual_page);
+	unsigned int gen;
+	struct DmaAddrCache *pCache;
+	void __iomem *pBus;
 
-	if (pUser >= g_pMinPhys && pUser < g_pMaxPhys)
+	if (pUser >= pCtx->m_pMinPhys && pUser < pCtx->m_pMaxPhys)
 	{
 		PRINTK_VERBOSE(KERN_DEBUG "user->phys passthrough on %p\n", pUser);
-		return (void __iomem *)((unsigned long)pUser + g_physOffset);
+		return (void __iomem *)((unsigned long)pUser + pCtx->m_physOffset);
 	}
 
-	//check the cache for our entry
-	for (count = 0; count < VIRT_TO_BUS_CACHE_SIZE; count++)
-		if (g_virtAddr[count] == virtual_page)
-		{
-			bus_addr = g_busAddr[count] + page_offset;
-			g_cacheHit++;
-			return (void __iomem *)bus_addr;
-		}
+	//pinned and translated already
+	pBus = UserVirtualToBusViaFixed(pCtx, pUser);
+	if (pBus)
+		return pBus;
+
+	//the cache only describes the opener's address space
+	if (current->mm != pCtx->m_pMm)
+		return UserVirtualToBus(pUser);
+
+	//check this cpu's cache for our entry
+	pCache = AddrCache(pCtx, get_cpu());
+	spin_lock(&pCache->m_lock);
+
+	if (pCache->m_virtAddr[slot] == virtual_page)
+	{
+		bus_addr = pCache->m_busAddr[slot] + page_offset;
+		pCache->m_cacheHit++;
+		spin_unlock(&pCache->m_lock);
+		put_cpu();
+		return (void __iomem *)bus_addr;
+	}
+
+	spin_unlock(&pCache->m_lock);
+	put_cpu();
 
 	//not found, look up manually and then insert its page address
+	gen = atomic_read(&pCtx->m_addrCacheGen);
 	bus_addr = (unsigned long)UserVirtualToBus(pUser);
 
 	if (!bus_addr)
 		return 0;
 
-	g_virtAddr[g_cacheInsertAt] = virtual_page;
-	g_busAddr[g_cacheInsertAt] = bus_addr & ~4095;
-
-	//round robin
-	g_cacheInsertAt++;
-	if (g_cacheInsertAt == VIRT_TO_BUS_CACHE_SIZE)
-		g_cacheInsertAt = 0;
-
-	g_cacheMiss++;
+	//unless the mapping changed while we were looking
+	pCache = AddrCache(pCtx, get_cpu());
+	spin_lock(&pCache->m_lock);
+	if (gen == atomic_read(&pCtx->m_addrCacheGen))
+	{
+		pCache->m_virtAddr[slot] = virtual_page;
+		pCache->m_busAddr[slot] = bus_addr & ~4095;
+	}
+	pCache->m_cacheMiss++;
+	spin_unlock(&pCache->m_lock);
+	put_cpu();
 
 	return (void __iomem *)bus_addr;
 }
 
-/***** FILE OPERATIONS ****/
-static int Open(struct inode *pInode, struct file *pFile)
+/****** FIXED BUFFERS ******/
+static void FreeFixedBuffer(struct DmaFixedBuffer *pBuffer, unsigned int pinned)
 {
-	PRINTK(KERN_DEBUG "file opening: %d/%d\n", imajor(pInode), iminor(pInode));
-	
-	//check which device we are
-	if (iminor(pInode) == 0)		//4k
+	unsigned int count;
+
+	//the dma may have written to any of them
+	for (count = 0; count < pinned; count++)
 	{
-		//only one at a time
-		if (!atomic_dec_and_test(&g_oneLock4k))
-		{
-			atomic_inc(&g_oneLock4k);
-			return -EBUSY;
-		}
+		if (pBuffer->m_write)
+			set_page_dirty_lock(pBuffer->m_ppPages[count]);
+		page_cache_release(pBuffer->m_ppPages[count]);
 	}
-	else
-		return -EINVAL;
-	
-	//todo there will be trouble if two different processes open the files
-
-	//reset after any file is opened
-	g_pMinPhys = (void __user *)-1;
-	g_pMaxPhys = (void __user *)0;
-	g_physOffset = 0;
-	g_cmaHandle = 0;
 
-	return 0;
+	vfree(pBuffer->m_pBusPages);
+	vfree(pBuffer->m_ppPages);
+	kfree(pBuffer);
 }
 
-static int Release(struct inode *pInode, struct file *pFile)
+//pin and translate a user range, for as long as the caller holds on to it
+//returns zero on failure, with the reason in pError
+static struct DmaFixedBuffer *PinUserRange(unsigned long start, unsigned long length, int write, int *pError)
 {
-	PRINTK(KERN_DEBUG "file closing, %d pages tracked\n", g_trackedPages);
-	if (g_trackedPages)
-		PRINTK(KERN_ERR "we\'re leaking memory!\n");
-	
-	//wait for any dmas to finish
-	DmaWaitAll();
+	struct DmaFixedBuffer *pBuffer;
+	int pinned, count;
 
-	//free this memory on the application closing the file or it crashing (implicitly closing the file)
-	if (g_cmaHandle)
+	if (!length || start + length < start || start + length > TASK_SIZE)
 	{
-		PRINTK(KERN_DEBUG "unlocking vc memory\n");
-		if (UnlockVcMemory(g_cmaHandle))
-			PRINTK(KERN_ERR "uh-oh, unable to unlock vc memory!\n");
-		PRINTK(KERN_DEBUG "releasing vc memory\n");
-		if (ReleaseVcMemory(g_cmaHandle))
-			PRINTK(KERN_ERR "uh-oh, unable to release vc memory!\n");
+		*pError = -EINVAL;
+		return 0;
 	}
 
-	if (iminor(pInode) == 0)
-		atomic_inc(&g_oneLock4k);
-	else
-		return -EINVAL;
+	pBuffer = (struct DmaFixedBuffer *)kzalloc(sizeof(struct DmaFixedBuffer), GFP_KERNEL);
+	if (!pBuffer)
+	{
+		*pError = -ENOMEM;
+		return 0;
+	}
 
-	return 0;
-}
+	pBuffer->m_start = start;
+	pBuffer->m_end = start + length;
+	pBuffer->m_pMm = current->mm;
+	pBuffer->m_write = write;
+	pBuffer->m_numPages = ((PAGE_ALIGN(pBuffer->m_end) - (start & ~4095)) >> PAGE_SHIFT);
 
-static struct DmaControlBlock __user *DmaPrepare(struct DmaControlBlock __user *pUserCB, int *pError)
-{
-	struct DmaControlBlock kernCB;
-	struct DmaControlBlock __user *pUNext;
-	void __iomem *pSourceBus, __iomem *pDestBus;
-	
-	//get the control block into kernel memory so we can work on it
-	if (copy_from_user(&kernCB, pUserCB, sizeof(struct DmaControlBlock)) != 0)
+	pBuffer->m_ppPages = (struct page **)vmalloc(pBuffer->m_numPages * sizeof(struct page *));
+	pBuffer->m_pBusPages = (unsigned long *)vmalloc(pBuffer->m_numPages * sizeof(unsigned long));
+	if (!pBuffer->m_ppPages || !pBuffer->m_pBusPages)
 	{
-		PRINTK(KERN_ERR "copy_from_user failed for user cb %p\n", pUserCB);
-		*pError = 1;
+		FreeFixedBuffer(pBuffer, 0);
+		*pError = -ENOMEM;
 		return 0;
 	}
-	
-	if (kernCB.m_pSourceAddr == 0 || kernCB.m_pDestAddr == 0)
+
+	//take a reference on every page so they stay put for as long as the caller needs them
+	pinned = get_user_pages_fast(start & ~4095, pBuffer->m_numPages, write, pBuffer->m_ppPages);
+	if (pinned != pBuffer->m_numPages)
 	{
-		PRINTK(KERN_ERR "faulty source (%p) dest (%p) addresses for user cb %p\n",
-			kernCB.m_pSourceAddr, kernCB.m_pDestAddr, pUserCB);
-		*pError = 1;
+		PRINTK(KERN_ERR "only pinned %d of %d pages at %08lx\n", pinned, pBuffer->m_numPages, start);
+		FreeFixedBuffer(pBuffer, pinned > 0 ? pinned : 0);
+		*pError = -EFAULT;
 		return 0;
 	}
 
-	pSourceBus = UserVirtualToBusViaCache(kernCB.m_pSourceAddr);
-	pDestBus = UserVirtualToBusViaCache(kernCB.m_pDestAddr);
+	for (count = 0; count < pinned; count++)
+		pBuffer->m_pBusPages[count] = __virt_to_bus(page_address(pBuffer->m_ppPages[count]));
 
-	if (!pSourceBus || !pDestBus)
+	return pBuffer;
+}
+
+//pin and translate a user range, returning its handle or a negative error
+static int RegisterFixedBuffer(struct DmaContext *pCtx, void __user *pAddr, unsigned long length)
+{
+	struct DmaFixedBuffer *pBuffer;
+	int count, error, handle = -ENOSPC;
+
+	pBuffer = PinUserRange((unsigned long)pAddr, length, 1, &error);
+	if (!pBuffer)
+		return error;
+
+	write_lock(&pCtx->m_fixedLock);
+	for (count = 0; count < DMA_MAX_FIXED_BUFFERS; count++)
+		if (!pCtx->m_pFixedBuffers[count])
+		{
+			pCtx->m_pFixedBuffers[count] = pBuffer;
+			atomic_inc(&pCtx->m_numFixed);
+			handle = count + 1;
+			break;
+		}
+	write_unlock(&pCtx->m_fixedLock);
+
+	if (handle < 0)
+	{
+		PRINTK(KERN_ERR "too many registered buffers\n");
+		FreeFixedBuffer(pBuffer, pBuffer->m_numPages);
+		return handle;
+	}
+
+	PRINTK_VERBOSE(KERN_DEBUG "registered buffer %d, %p length %ld, %d pages\n", handle, pAddr, length, pBuffer->m_numPages);
+
+	return handle;
+}
+
+static int UnregisterFixedBuffer(struct DmaContext *pCtx, unsigned long handle)
+{
+	struct DmaFixedBuffer *pBuffer;
+
+	if (handle < 1 || handle > DMA_MAX_FIXED_BUFFERS)
+		return -EINVAL;
+
+	write_lock(&pCtx->m_fixedLock);
+	pBuffer = pCtx->m_pFixedBuffers[handle - 1];
+	pCtx->m_pFixedBuffers[handle - 1] = 0;
+	if (pBuffer)
+		atomic_dec(&pCtx->m_numFixed);
+	write_unlock(&pCtx->m_fixedLock);
+
+	if (!pBuffer)
+		return -EINVAL;
+
+	//the pages can't be let go while a chain may still be using them
+	DmaWaitAll(pCtx);
+
+	FreeFixedBuffer(pBuffer, pBuffer->m_numPages);
+
+	return 0;
+}
+
+/***** FILE OPERATIONS ****/
+static int Open(struct inode *pInode, struct file *pFile)
+{
+	struct DmaContext *pCtx;
+
+	PRINTK(KERN_DEBUG "file opening: %d/%d\n", imajor(pInode), iminor(pInode));
+	
+	//check which device we are
+	if (iminor(pInode) != 0)		//4k
+		return -EINVAL;
+
+	//each open gets its own state, so any number of processes can use the device at once
+	pCtx = (struct DmaContext *)vzalloc(sizeof(struct DmaContext));
+	if (!pCtx)
+		return -ENOMEM;
+
+	//passthrough off
+	pCtx->m_pMinPhys = (void __user *)-1;
+	pCtx->m_pMaxPhys = (void __user *)0;
+
+	if (AllocAddrCaches(pCtx))
+	{
+		vfree(pCtx);
+		return -ENOMEM;
+	}
+
+	rwlock_init(&pCtx->m_fixedLock);
+	mutex_init(&pCtx->m_chainLock);
+	mutex_init(&pCtx->m_ringLock);
+	init_waitqueue_head(&pCtx->m_retiredWait);
+
+	//translations are cached for this process until its mappings change
+	FlushAddrCache(pCtx);
+	pCtx->m_pMm = current->mm;
+	atomic_inc(&pCtx->m_pMm->mm_count);
+
+#ifdef CONFIG_MMU_NOTIFIER
+	pCtx->m_mmuNotifier.ops = &g_mmuOps;
+	if (mmu_notifier_register(&pCtx->m_mmuNotifier, pCtx->m_pMm))
+	{
+		PRINTK(KERN_ERR "failed to register mmu notifier\n");
+		mmdrop(pCtx->m_pMm);
+		FreeAddrCaches(pCtx);
+		vfree(pCtx);
+		return -ENOMEM;
+	}
+#endif
+
+	pFile->private_data = pCtx;
+
+	return 0;
+}
+
+static int Release(struct inode *pInode, struct file *pFile)
+{
+	struct DmaContext *pCtx = (struct DmaContext *)pFile->private_data;
+	int count, cpu;
+	int hits = 0, misses = 0;
+
+	for_each_possible_cpu(cpu)
+	{
+		hits += AddrCache(pCtx, cpu)->m_cacheHit;
+		misses += AddrCache(pCtx, cpu)->m_cacheMiss;
+	}
+
+	PRINTK(KERN_DEBUG "file closing, %d pages tracked, cache stats: %d hits %d misses\n",
+		g_trackedPages, hits, misses);
+	
+	//wait for any of our dmas to finish
+	DmaWaitAll(pCtx);
+
+	//drop any chains left registered
+	for (count = 0; count < DMA_MAX_CHAINS; count++)
+		if (pCtx->m_pChains[count])
+			ChainUnregister(pCtx, count + 1);
+
+	//unpin anything left registered
+	for (count = 0; count < DMA_MAX_FIXED_BUFFERS; count++)
+		if (pCtx->m_pFixedBuffers[count])
+			UnregisterFixedBuffer(pCtx, count + 1);
+
+#ifdef CONFIG_MMU_NOTIFIER
+	mmu_notifier_unregister(&pCtx->m_mmuNotifier, pCtx->m_pMm);
+#endif
+	mmdrop(pCtx->m_pMm);
+	FreeAddrCaches(pCtx);
+
+	//nothing of ours is queued now, so nothing can signal it
+	if (pCtx->m_pEventFd)
+		eventfd_ctx_put(pCtx->m_pEventFd);
+
+	if (pCtx->m_retiredOverflow)
+		PRINTK(KERN_DEBUG "%d retired fences were dropped unread\n", pCtx->m_retiredOverflow);
+
+	//nothing can still be mapped as the mapping holds the file open
+	if (pCtx->m_pRings)
+		free_pages((unsigned long)pCtx->m_pRings, get_order(sizeof(struct DmaRings)));
+
+	//free this memory on the application closing the file or it crashing (implicitly closing the file)
+	if (pCtx->m_cmaHandle)
+	{
+		PRINTK(KERN_DEBUG "unlocking vc memory\n");
+		if (UnlockVcMemory(pCtx->m_cmaHandle))
+			PRINTK(KERN_ERR "uh-oh, unable to unlock vc memory!\n");
+		PRINTK(KERN_DEBUG "releasing vc memory\n");
+		if (ReleaseVcMemory(pCtx->m_cmaHandle))
+			PRINTK(KERN_ERR "uh-oh, unable to release vc memory!\n");
+	}
+
+	vfree(pCtx);
+	pFile->private_data = 0;
+
+	return 0;
+}
+
+//limits for a given channel, or that suit any of them if it's not known where the chain will run
+static unsigned int DmaMaxBurst(struct DmaChannel *pChannel)
+{
+	unsigned int burst = 10;
+	int count;
+
+	for (count = 0; count < g_numChannels; count++)
+		if (!pChannel || pChannel == &g_channels[count])
+			if (g_channels[count].m_chan >= DMA_FIRST_LITE_CHANNEL)
+				burst = 5;
+
+	return burst;
+}
+
+static unsigned int DmaMaxXferLen(struct DmaChannel *pChannel)
+{
+	unsigned int length = DMA_MAX_XFER_LEN;
+	int count;
+
+	for (count = 0; count < g_numChannels; count++)
+		if (!pChannel || pChannel == &g_channels[count])
+			if (g_channels[count].m_chan >= DMA_FIRST_LITE_CHANNEL)
+				length = DMA_MAX_XFER_LEN_LITE;
+
+	return length;
+}
+
+//can two translated blocks, the second following straight on from the first, be done as one
+static inline int DmaCanMerge(const struct DmaControlBlock *pFirst, const struct DmaControlBlock *pSecond,
+		unsigned int maxLength)
+{
+	unsigned int ti = pFirst->m_transferInfo;
+	unsigned long source_end, dest_end;
+
+	//only plain linear blocks, and not ones the user wanted to hear about
+	if (ti != pSecond->m_transferInfo || (ti & (DMA_TI_TDMODE | DMA_TI_INTEN)))
+		return 0;
+
+	if (pFirst->m_xferLen + pSecond->m_xferLen > maxLength)
+		return 0;
+
+	//a fixed address (eg a peripheral fifo) has to stay the same, otherwise the second has to carry on where the first ends
+	source_end = (unsigned long)pFirst->m_pSourceAddr + ((ti & DMA_TI_SRC_INC) ? pFirst->m_xferLen : 0);
+	dest_end = (unsigned long)pFirst->m_pDestAddr + ((ti & DMA_TI_DEST_INC) ? pFirst->m_xferLen : 0);
+
+	return source_end == (unsigned long)pSecond->m_pSourceAddr
+		&& dest_end == (unsigned long)pSecond->m_pDestAddr;
+}
+
+/****** CACHE MAINTENANCE ******/
+//there's no outer cache on the arm side of the bcm2835, so only the l1 is dealt with
+static void DmaCacheKernelOp(void *pAddr, unsigned long length, unsigned int op)
+{
+	if (op == DMA_CACHE_FLUSH)
+		__cpuc_flush_dcache_area(pAddr, length);
+	else if (op == DMA_CACHE_CLEAN)
+		dmac_map_area(pAddr, length, DMA_TO_DEVICE);
+	else if (op == DMA_CACHE_INVALIDATE)
+		dmac_unmap_area(pAddr, length, DMA_FROM_DEVICE);
+}
+
+//the maintenance ops don't fault like a load would, and take the kernel down on an unmapped user address
+//so the pages are pinned and worked on through the linear map, which neither core's d-cache aliases with
+//returns non-zero if the range isn't the caller's to touch
+static int DmaCacheRangeOp(struct DmaContext *pCtx, void __user *pAddr, unsigned long length, unsigned int op)
+{
+	struct page *pPages[DMA_CACHE_PIN_BATCH];
+	unsigned long start = (unsigned long)pAddr, end = start + length;
+	unsigned long chunk;
+	int pinned, count;
+
+	//passthrough addresses aren't cached mappings of ours
+	if (pAddr >= pCtx->m_pMinPhys && pAddr < pCtx->m_pMaxPhys)
+		return 0;
+
+	if (!access_ok(VERIFY_READ, pAddr, length))
+		return 1;
+
+	while (start < end)
+	{
+		pinned = min((PAGE_ALIGN(end) - (start & PAGE_MASK)) >> PAGE_SHIFT, (unsigned long)DMA_CACHE_PIN_BATCH);
+		pinned = get_user_pages_fast(start & PAGE_MASK, pinned, 0, pPages);
+
+		if (pinned <= 0)
+		{
+			PRINTK(KERN_ERR "no page under %08lx for cache maintenance\n", start);
+			return 1;
+		}
+
+		for (count = 0; count < pinned; count++)
+		{
+			chunk = min(end - start, PAGE_SIZE - offset_in_page(start));
+			DmaCacheKernelOp(page_address(pPages[count]) + offset_in_page(start), chunk, op);
+			page_cache_release(pPages[count]);
+			start += chunk;
+		}
+	}
+
+	return 0;
+}
+
+//one side of a translated CB through the kernel's linear map, a row at a time in 2d mode
+//anything outside it, a peripheral or passthrough memory, isn't cached by us
+static void DmaCacheBusSide(struct DmaControlBlock *pCB, void __iomem *pBus, unsigned int inc, short stride, unsigned int op)
+{
+	unsigned int xlen = pCB->m_xferLen, rows = 1;
+	char *pAddr;
+
+	//a fixed address is one word, at most 128 bits
+	if (!(pCB->m_transferInfo & inc))
+		xlen = 16;
+	else if (pCB->m_transferInfo & DMA_TI_TDMODE)
+	{
+		xlen = pCB->m_xferLen & 0xffff;
+		rows = pCB->m_xferLen >> 16;
+	}
+
+	for (pAddr = (char *)__bus_to_virt((unsigned long)pBus); rows--; pAddr += xlen + stride)
+		if (xlen && virt_addr_valid(pAddr) && virt_addr_valid(pAddr + xlen - 1))
+			DmaCacheKernelOp(pAddr, xlen, op);
+}
+
+//follow a job's blocks as the engine does, cleaning what they read and clean+invalidating what they write
+//afterwards, on a core which fills speculatively, only what they wrote, which can't lose anything if the blocks have been scribbled on
+//the module's own blocks are read where it keeps them, a chain in user memory through the linear map, where at worst it costs needless maintenance
+//can take a while, so must not be called with the job lock held
+static void DmaAutoCacheJob(struct DmaJob *pJob, int after)
+{
+	unsigned long bus = pJob->m_busHead;
+	unsigned int steps = pJob->m_pKernCBs ? pJob->m_kernCount : DMA_MAX_CHAIN_CBS;
+	struct DmaControlBlock *pCB;
+
+	while (bus && steps--)
+	{
+		if (pJob->m_pKernCBs)
+		{
+			//a pool job's tail may be linked on to the next job
+			if (bus < pJob->m_busHead || bus >= pJob->m_busHead + pJob->m_kernCount * sizeof(struct DmaControlBlock))
+				break;
+			pCB = &pJob->m_pKernCBs[(bus - pJob->m_busHead) / sizeof(struct DmaControlBlock)];
+		}
+		else
+		{
+			pCB = (struct DmaControlBlock *)__bus_to_virt(bus);
+			if (!virt_addr_valid(pCB))
+				break;
+		}
+
+		if (!after)
+			DmaCacheBusSide(pCB, pCB->m_pSourceAddr, DMA_TI_SRC_INC, (short)(pCB->m_tdStride & 0xffff), DMA_CACHE_CLEAN);
+		DmaCacheBusSide(pCB, pCB->m_pDestAddr, DMA_TI_DEST_INC, (short)(pCB->m_tdStride >> 16), DMA_CACHE_FLUSH);
+
+		bus = (unsigned long)pCB->m_pNext;
+
+		//around a loop
+		if (bus == pJob->m_busHead)
+			break;
+	}
+}
+
+static int DmaCacheOp(struct DmaContext *pCtx, struct DmaCacheRangeList __user *pUserList)
+{
+	struct DmaCacheRangeList list;
+	struct DmaCacheRange *pRanges;
+	unsigned int done, count, i;
+	int error = 0;
+
+	if (copy_from_user(&list, pUserList, sizeof(list)) != 0)
+		return -EFAULT;
+
+	if (list.m_op == 0 || (list.m_op & ~DMA_CACHE_FLUSH))
+		return -EINVAL;
+
+	pRanges = (struct DmaCacheRange *)kmalloc(DMA_CACHE_CHUNK * sizeof(struct DmaCacheRange), GFP_KERNEL);
+	if (!pRanges)
+		return -ENOMEM;
+
+	for (done = 0; done < list.m_count && !error; done += count)
+	{
+		count = min(list.m_count - done, (unsigned int)DMA_CACHE_CHUNK);
+
+		if (copy_from_user(pRanges, list.m_pRanges + done, count * sizeof(struct DmaCacheRange)) != 0)
+		{
+			error = -EFAULT;
+			break;
+		}
+
+		for (i = 0; i < count; i++)
+		{
+			//clean+invalidate of everything covers any op on any range
+			//it goes by set and way on this cpu alone, so is no good where another may hold the lines
+			if (!IS_ENABLED(CONFIG_SMP) && pRanges[i].m_length >= DMA_CACHE_ALL_BYTES)
+			{
+				flush_cache_all();
+				goto out;
+			}
+
+			if (DmaCacheRangeOp(pCtx, pRanges[i].m_pAddr, pRanges[i].m_length, list.m_op))
+			{
+				PRINTK(KERN_ERR "bad cache range %p+%d\n", pRanges[i].m_pAddr, pRanges[i].m_length);
+				error = -EFAULT;
+				break;
+			}
+		}
+	}
+
+out:
+	kfree(pRanges);
+	return error;
+}
+
+/****** PREPARATION ******/
+//translate the source and destination of a CB which has been copied into kernel memory
+//returns non-zero on failure
+static int DmaTranslateCB(struct DmaContext *pCtx, struct DmaControlBlock *pCB)
+{
+	void __iomem *pSourceBus, __iomem *pDestBus;
+
+	if (pCB->m_pSourceAddr == 0 || pCB->m_pDestAddr == 0)
+	{
+		PRINTK(KERN_ERR "faulty source (%p) dest (%p) addresses\n",
+			pCB->m_pSourceAddr, pCB->m_pDestAddr);
+		return 1;
+	}
+
+	pSourceBus = UserVirtualToBusViaCache(pCtx, pCB->m_pSourceAddr);
+	pDestBus = UserVirtualToBusViaCache(pCtx, pCB->m_pDestAddr);
+
+	if (!pSourceBus || !pDestBus)
 	{
 		PRINTK(KERN_ERR "virtual to bus translation failure for source/dest %p/%p->%p/%p\n",
-				kernCB.m_pSourceAddr, kernCB.m_pDestAddr,
+				pCB->m_pSourceAddr, pCB->m_pDestAddr,
 				pSourceBus, pDestBus);
+		return 1;
+	}
+	
+	//update the structure with the new bus addresses
+	pCB->m_pSourceAddr = pSourceBus;
+	pCB->m_pDestAddr = pDestBus;
+
+	PRINTK_VERBOSE(KERN_DEBUG "final source %p dest %p\n", pCB->m_pSourceAddr, pCB->m_pDestAddr);
+
+	return 0;
+}
+
+static struct DmaControlBlock __user *DmaPrepare(struct DmaContext *pCtx, struct DmaControlBlock __user *pUserCB, int *pError)
+{
+	struct DmaControlBlock kernCB;
+	struct DmaControlBlock __user *pUNext;
+	
+	//get the control block into kernel memory so we can work on it
+	if (copy_from_user(&kernCB, pUserCB, sizeof(struct DmaControlBlock)) != 0)
+	{
+		PRINTK(KERN_ERR "copy_from_user failed for user cb %p\n", pUserCB);
 		*pError = 1;
 		return 0;
 	}
 	
-	//update the user structure with the new bus addresses
-	kernCB.m_pSourceAddr = pSourceBus;
-	kernCB.m_pDestAddr = pDestBus;
-
-	PRINTK_VERBOSE(KERN_DEBUG "final source %p dest %p\n", kernCB.m_pSourceAddr, kernCB.m_pDestAddr);
+	if (DmaTranslateCB(pCtx, &kernCB))
+	{
+		PRINTK(KERN_ERR "failed to prepare user cb %p\n", pUserCB);
+		*pError = 1;
+		return 0;
+	}
 		
 	//sort out the bus address for the next block
 	pUNext = kernCB.m_pNext;
@@ -397,7 +1609,7 @@ static struct DmaControlBlock __user *DmaPrepare(struct DmaControlBlock __user *
 	if (kernCB.m_pNext)
 	{
 		void __iomem *pNextBus;
-		pNextBus = UserVirtualToBusViaCbCache(kernCB.m_pNext);
+		pNextBus = UserVirtualToBusViaCbCache(pCtx, kernCB.m_pNext);
 
 		if (!pNextBus)
 		{
@@ -406,77 +1618,2084 @@ static struct DmaControlBlock __user *DmaPrepare(struct DmaControlBlock __user *
 			return 0;
 		}
 
-		//update the pointer with the bus address
-		kernCB.m_pNext = pNextBus;
+		//update the pointer with the bus address
+		kernCB.m_pNext = pNextBus;
+	}
+	else
+	{
+		//last block in the chain, raise an interrupt when it is done so waiters can be woken
+		kernCB.m_transferInfo |= DMA_TI_INTEN;
+	}
+	
+	//write it back to user space
+	if (copy_to_user(pUserCB, &kernCB, sizeof(struct DmaControlBlock)) != 0)
+	{
+		PRINTK(KERN_ERR "copy_to_user failed for cb %p\n", pUserCB);
+		*pError = 1;
+		return 0;
+	}
+
+	__cpuc_flush_dcache_area(pUserCB, 32);
+
+	*pError = 0;
+	return pUNext;
+}
+
+//translate a whole chain, returning non-zero on failure
+static int DmaPrepareChain(struct DmaContext *pCtx, struct DmaControlBlock __user *pUCB)
+{
+	int error = 0;
+	int steps = 0;
+	unsigned long start_time = jiffies;
+	(void)start_time;
+
+#ifndef CONFIG_MMU_NOTIFIER
+	//nothing tells us when the process's mappings change, so start afresh each time
+	FlushAddrCache(pCtx);
+#endif
+
+	PRINTK_VERBOSE(KERN_DEBUG "dma prepare\n");
+
+	//do virtual to bus translation for each entry
+	do
+	{
+		pUCB = DmaPrepare(pCtx, pUCB, &error);
+	} while (error == 0 && ++steps && pUCB);
+	PRINTK_VERBOSE(KERN_DEBUG "prepare done in %d steps, %ld\n", steps, jiffies - start_time);
+
+	return error;
+}
+
+//translate a contiguous array of CBs in bulk, returning zero or a negative error
+static int DmaPrepareArray(struct DmaContext *pCtx, struct DmaPrepareArray __user *pUserArray)
+{
+	struct DmaPrepareArray array;
+	struct DmaControlBlock *pCBs;
+	unsigned int done, count, run;
+	int error = 0;
+
+	if (copy_from_user(&array, pUserArray, sizeof(array)) != 0)
+		return -EFAULT;
+
+	if (array.m_count == 0 || array.m_count > DMA_MAX_CHAIN_CBS)
+		return -EINVAL;
+
+	pCBs = (struct DmaControlBlock *)kmalloc(DMA_PREPARE_CHUNK * sizeof(struct DmaControlBlock), GFP_KERNEL);
+	if (!pCBs)
+		return -ENOMEM;
+
+#ifndef CONFIG_MMU_NOTIFIER
+	FlushAddrCache(pCtx);
+#endif
+
+	for (done = 0; done < array.m_count && !error; done += count)
+	{
+		unsigned int i;
+
+		count = min(array.m_count - done, (unsigned int)DMA_PREPARE_CHUNK);
+
+		if (copy_from_user(pCBs, array.m_pCBs + done, count * sizeof(struct DmaControlBlock)) != 0)
+		{
+			PRINTK(KERN_ERR "copy_from_user failed for user cbs %p\n", array.m_pCBs + done);
+			error = -EFAULT;
+			break;
+		}
+
+		for (i = 0; i < count; i++)
+			if (DmaTranslateCB(pCtx, &pCBs[i]))
+			{
+				PRINTK(KERN_ERR "failed to prepare user cb %p\n", array.m_pCBs + done + i);
+				error = -EINVAL;
+				break;
+			}
+
+		count = i;
+
+		//fold a block into the run before it when it is linked straight after and carries on physically
+		//the folded block is still written back, fully prepared, in case it is kicked on its own
+		for (i = 0, run = 0; i < count; i++)
+			if (i > run
+					&& pCBs[run].m_pNext == array.m_pCBs + done + i
+					&& DmaCanMerge(&pCBs[run], &pCBs[i], DmaMaxXferLen(0)))
+			{
+				pCBs[run].m_xferLen += pCBs[i].m_xferLen;
+				pCBs[run].m_pNext = pCBs[i].m_pNext;
+				PRINTK_VERBOSE(KERN_DEBUG "merged cb %d into %d\n", done + i, done + run);
+			}
+			else
+				run = i;
+
+		for (i = 0; i < count; i++)
+		{
+			if (pCBs[i].m_pNext)
+			{
+				void __iomem *pNextBus = UserVirtualToBusViaCbCache(pCtx, pCBs[i].m_pNext);
+
+				if (!pNextBus)
+				{
+					PRINTK(KERN_ERR "virtual to bus translation failure for m_pNext\n");
+					error = -EINVAL;
+					break;
+				}
+
+				pCBs[i].m_pNext = pNextBus;
+			}
+			else
+				pCBs[i].m_transferInfo |= DMA_TI_INTEN;
+		}
+
+		//write back whatever was translated, as walking the chain block by block would have
+		if (copy_to_user(array.m_pCBs + done, pCBs, i * sizeof(struct DmaControlBlock)) != 0)
+		{
+			PRINTK(KERN_ERR "copy_to_user failed for cbs %p\n", array.m_pCBs + done);
+			error = -EFAULT;
+		}
+	}
+
+	kfree(pCBs);
+
+	//one flush for the lot, rather than one per block, only when there is a chain to kick
+	//done only counts blocks which were written back, and the array can be unmapped under us since
+	if (!error && DmaCacheRangeOp(pCtx, array.m_pCBs, done * sizeof(struct DmaControlBlock), DMA_CACHE_FLUSH))
+		error = -EFAULT;
+
+	if (!error)
+	{
+		pCtx->m_pArrayCBs = array.m_pCBs;
+		pCtx->m_arrayCount = array.m_count;
+	}
+
+	return error;
+}
+
+/****** CB POOL ******/
+//returns the index of a run of free blocks, or -1
+static int CbPoolAlloc(unsigned int count)
+{
+	unsigned long index;
+	unsigned long flags;
+
+	spin_lock_irqsave(&g_cbPoolLock, flags);
+
+	index = bitmap_find_next_zero_area(g_cbPoolMap, DMA_CB_POOL_SIZE, 0, count, 0);
+	if (index < DMA_CB_POOL_SIZE)
+		bitmap_set(g_cbPoolMap, index, count);
+
+	spin_unlock_irqrestore(&g_cbPoolLock, flags);
+
+	if (index >= DMA_CB_POOL_SIZE)
+		return -1;
+
+	return index;
+}
+
+//if the pool is taken up by chains in flight, let them drain and try again
+static int CbPoolAllocWait(unsigned int count)
+{
+	int first = CbPoolAlloc(count);
+
+	if (first < 0)
+	{
+		DmaWait(0, 0);
+		first = CbPoolAlloc(count);
+	}
+
+	return first;
+}
+
+static void CbPoolFree(unsigned int first, unsigned int count)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&g_cbPoolLock, flags);
+	bitmap_clear(g_cbPoolMap, first, count);
+	spin_unlock_irqrestore(&g_cbPoolLock, flags);
+}
+
+static inline dma_addr_t CbPoolBus(unsigned int index)
+{
+	return g_busCbPool + index * sizeof(struct DmaControlBlock);
+}
+
+/****** JOB QUEUE ******/
+static inline int DmaIsIdle(struct DmaChannel *pChannel)
+{
+	return (readl(pChannel->m_pBase + DMA_REG_CS) & DMA_CS_ACTIVE) == 0;
+}
+
+//has this fence been handed out yet
+static inline int DmaFenceIssued(unsigned int fence)
+{
+	return fence != 0 && fence <= DMA_FENCE_MASK
+		&& (((unsigned int)atomic_read(&g_fenceIssued) - fence) & DMA_FENCE_MASK) <= (DMA_FENCE_MASK >> 1);
+}
+
+//must be called with the job lock held
+static void DmaPostCompletion(struct DmaContext *pCtx, unsigned int userData, unsigned int fence, int status)
+{
+	struct DmaCompletion *pComp;
+	unsigned int tail;
+
+	if (!pCtx->m_pRings)
+		return;
+
+	tail = pCtx->m_pRings->m_compTail;
+
+	//user space has fallen behind, drop it rather than overwrite something unread
+	if (tail - ACCESS_ONCE(pCtx->m_pRings->m_compHead) >= DMA_RING_COMP_ENTRIES)
+	{
+		pCtx->m_pRings->m_compOverflow++;
+		return;
+	}
+
+	pComp = &pCtx->m_pRings->m_comp[tail & (DMA_RING_COMP_ENTRIES - 1)];
+	pComp->m_userData = userData;
+	pComp->m_fence = fence;
+	pComp->m_status = status;
+	pComp->m_timestampNs = ktime_to_ns(ktime_get());
+
+	//the entry must be visible before the new tail
+	smp_wmb();
+	pCtx->m_pRings->m_compTail = tail + 1;
+}
+
+//tell whoever is listening on the file that a fence has retired
+//must be called with the job lock held
+static void DmaPostRetired(struct DmaContext *pCtx, unsigned int fence)
+{
+	unsigned int tail = pCtx->m_retiredTail;
+
+	//drop it rather than lose one which hasn't been read, as with the completion ring
+	if (tail - pCtx->m_retiredHead >= DMA_RETIRED_ENTRIES)
+		pCtx->m_retiredOverflow++;
+	else
+	{
+		pCtx->m_retired[tail & (DMA_RETIRED_ENTRIES - 1)] = fence;
+		pCtx->m_retiredTail = tail + 1;
+	}
+
+	wake_up_interruptible(&pCtx->m_retiredWait);
+	kill_fasync(&pCtx->m_pFasync, SIGIO, POLL_IN);
+
+	if (pCtx->m_pEventFd)
+		eventfd_signal(pCtx->m_pEventFd, 1);
+}
+
+//drop a reference to a shared fence, which retires with the last of them
+//must be called with the job lock held
+static void DmaPutSharedFence(struct DmaContext *pCtx, struct DmaSharedFence *pShared)
+{
+	if (!atomic_dec_and_test(&pShared->m_refs))
+		return;
+
+	//the submitter may not have kicked anything under it
+	if (pShared->m_fence)
+		DmaPostRetired(pCtx, pShared->m_fence);
+
+	kfree(pShared);
+}
+
+//tell everyone a job which is off every list has finished, and let it go
+//must be called with the job lock held
+static void DmaFinishJob(struct DmaJob *pJob, int status)
+{
+	if (pJob->m_flags & DMA_JOB_RING)
+		DmaPostCompletion(pJob->m_pCtx, pJob->m_userData, pJob->m_fence, status);
+
+	if (pJob->m_poolCount)
+		CbPoolFree(pJob->m_poolFirst, pJob->m_poolCount);
+
+	atomic_dec(&pJob->m_pCtx->m_queued);
+
+	//a shared fence only retires with the last of its jobs, once the submitter is done with it
+	if (pJob->m_pShared)
+		DmaPutSharedFence(pJob->m_pCtx, pJob->m_pShared);
+	else
+		DmaPostRetired(pJob->m_pCtx, pJob->m_fence);
+
+	kfree(pJob);
+}
+
+//status is zero if it ran to completion, or why it didn't
+//must be called with the job lock held
+static void DmaRetireJob(struct DmaJob *pJob, int status)
+{
+	PRINTK_VERBOSE(KERN_DEBUG "retiring fence %d, status %d\n", pJob->m_fence, status);
+
+	atomic_dec(&pJob->m_pChannel->m_queued);
+	list_del(&pJob->m_list);
+
+	//the maintenance can take far too long to do here, with interrupts off, so it still counts as running until it's done
+	if (pJob->m_flags & DMA_JOB_AUTO_CACHE)
+	{
+		pJob->m_status = status;
+		list_add_tail(&pJob->m_list, &g_autoCacheJobs);
+		schedule_work(&g_autoCacheWork);
+		return;
+	}
+
+	DmaFinishJob(pJob, status);
+}
+
+//is the engine part way through this job's pool blocks
+static inline int DmaInPool(struct DmaJob *pJob, dma_addr_t bus)
+{
+	return pJob->m_poolCount && bus >= CbPoolBus(pJob->m_poolFirst)
+		&& bus < CbPoolBus(pJob->m_poolFirst + pJob->m_poolCount);
+}
+
+//the job at the head of the queue is the one the engine is on, start it unless it was linked on already
+//must be called with the job lock held
+static void DmaStartHead(struct DmaChannel *pChannel)
+{
+	struct DmaJob *pJob;
+
+	if (list_empty(&pChannel->m_jobQueue))
+		return;
+
+	pJob = list_first_entry(&pChannel->m_jobQueue, struct DmaJob, m_list);
+	if (!pJob->m_started)
+	{
+		bcm_dma_start(pChannel->m_pBase, pJob->m_busHead);
+		pJob->m_started = 1;
+	}
+
+	pJob->m_startTime = jiffies;
+}
+
+//retire the running job once the channel has gone idle, and start the next one
+//jobs linked behind it were running too, so they go as well
+//must be called with the job lock held
+static void DmaServiceQueue(struct DmaChannel *pChannel)
+{
+	struct list_head *pQueue = &pChannel->m_jobQueue;
+	struct DmaJob *pJob;
+
+	while (!list_empty(pQueue))
+	{
+		pJob = list_first_entry(pQueue, struct DmaJob, m_list);
+
+		if (!DmaIsIdle(pChannel))
+		{
+			//still going, but it may have moved on into a job linked behind this one
+			struct DmaJob *pNext;
+
+			if (list_is_last(&pJob->m_list, pQueue))
+				break;
+
+			pNext = list_entry(pJob->m_list.next, struct DmaJob, m_list);
+			if (!pNext->m_started
+				|| !DmaInPool(pNext, readl(pChannel->m_pBase + DMA_REG_CONBLK_AD)))
+				break;
+		}
+
+		DmaRetireJob(pJob, 0);
+		DmaStartHead(pChannel);
+	}
+}
+
+//point the tail of a running job at the head of the next, so the engine carries straight on
+//returns zero if the engine had already finished, in which case the job must be started as normal
+//must be called with the job lock held
+static int DmaLinkJob(struct DmaChannel *pChannel, struct DmaJob *pTail, struct DmaJob *pJob)
+{
+	unsigned int tail = pTail->m_poolFirst + pTail->m_poolCount - 1;
+	unsigned int cs, conblk;
+
+	if (DmaIsIdle(pChannel))
+		return 0;
+
+	//if the engine hasn't yet got to the tail it'll pick this up when it does
+	g_pCbPool[tail].m_pNext = (struct DmaControlBlock *)pJob->m_busHead;
+	wmb();
+
+	//pause it, without acknowledging anything, so it can't move on while we look
+	cs = readl(pChannel->m_pBase + DMA_REG_CS) & ~(DMA_CS_END | DMA_CS_INT);
+	writel(cs & ~DMA_CS_ACTIVE, pChannel->m_pBase + DMA_REG_CS);
+
+	conblk = readl(pChannel->m_pBase + DMA_REG_CONBLK_AD);
+
+	//ran off the end before we got there
+	if (!conblk)
+		return 0;
+
+	//it loads the next pointer along with the cb, so if it's on the tail it has already seen the old one
+	if (conblk == CbPoolBus(tail))
+		writel(pJob->m_busHead, pChannel->m_pBase + DMA_REG_NEXTCONBK);
+
+	writel(cs | DMA_CS_ACTIVE, pChannel->m_pBase + DMA_REG_CS);
+
+	return 1;
+}
+
+//move what submitters have pushed onto the channel's queue, starting it if it was idle
+//must be called with the job lock held
+static void DmaTakeIncoming(struct DmaChannel *pChannel)
+{
+	struct llist_node *pNode, *pOrdered = 0;
+	struct DmaJob *pJob, *pTail;
+
+	//the list comes off newest first
+	pNode = llist_del_all(&pChannel->m_incoming);
+	while (pNode)
+	{
+		struct llist_node *pNext = pNode->next;
+		pNode->next = pOrdered;
+		pOrdered = pNode;
+		pNode = pNext;
+	}
+
+	for (pNode = pOrdered; pNode; pNode = pNode->next)
+	{
+		pJob = llist_entry(pNode, struct DmaJob, m_node);
+		pTail = list_empty(&pChannel->m_jobQueue) ? 0 : list_entry(pChannel->m_jobQueue.prev, struct DmaJob, m_list);
+
+		list_add_tail(&pJob->m_list, &pChannel->m_jobQueue);
+
+		//start it now if nothing is ahead of it, or tack it on to what is running if we own its tail
+		//otherwise the queue will get to it
+		if (!pTail)
+			DmaStartHead(pChannel);
+		else if (pTail->m_started && pTail->m_poolCount && DmaLinkJob(pChannel, pTail, pJob))
+			pJob->m_started = 1;
+	}
+
+	//anything which didn't make it on in time gets started once what's ahead is retired
+	DmaServiceQueue(pChannel);
+}
+
+static void DmaServiceAll(void)
+{
+	int count;
+
+	for (count = 0; count < g_numChannels; count++)
+	{
+		DmaServiceQueue(&g_channels[count]);
+		DmaTakeIncoming(&g_channels[count]);
+	}
+}
+
+static int DmaIncomingPending(void)
+{
+	int count;
+
+	for (count = 0; count < g_numChannels; count++)
+		if (!llist_empty(&g_channels[count].m_incoming))
+			return 1;
+
+	return 0;
+}
+
+//drop the job lock, making sure nothing pushed while it was held gets left behind
+static void DmaUnlockJobs(unsigned long flags)
+{
+	spin_unlock_irqrestore(&g_jobLock, flags);
+
+	//whoever pushed it found the lock taken, so it's up to us
+	while (DmaIncomingPending() && spin_trylock_irqsave(&g_jobLock, flags))
+	{
+		DmaServiceAll();
+		spin_unlock_irqrestore(&g_jobLock, flags);
+	}
+}
+
+//throw away what the cpu pulled into the cache of finished jobs' destinations, then retire them
+static void DmaAutoCacheWork(struct work_struct *pWork)
+{
+	struct DmaJob *pJob;
+	unsigned long flags;
+
+	//in case it's run on another cpu while already running, only one works through the list
+	mutex_lock(&g_autoCacheLock);
+	spin_lock_irqsave(&g_jobLock, flags);
+
+	while (!list_empty(&g_autoCacheJobs))
+	{
+		//left on the list meanwhile, so it's still being waited for, and its blocks are still there
+		pJob = list_first_entry(&g_autoCacheJobs, struct DmaJob, m_list);
+		DmaUnlockJobs(flags);
+
+		DmaAutoCacheJob(pJob, 1);
+
+		spin_lock_irqsave(&g_jobLock, flags);
+		list_del(&pJob->m_list);
+		DmaFinishJob(pJob, pJob->m_status);
+	}
+
+	DmaUnlockJobs(flags);
+	mutex_unlock(&g_autoCacheLock);
+
+	wake_up(&g_dmaWaitQueue);
+}
+
+//the channel with the least queued on it, which can change the moment we look
+static struct DmaChannel *DmaPickChannel(void)
+{
+	struct DmaChannel *pBest = &g_channels[0];
+	int count;
+
+	for (count = 1; count < g_numChannels; count++)
+		if (atomic_read(&g_channels[count].m_queued) < atomic_read(&pBest->m_queued))
+			pBest = &g_channels[count];
+
+	return pBest;
+}
+
+//has the chain with this fence finished
+//or if the fence is zero, everything kicked through the file, or by anyone if there's no file
+static int DmaRetired(struct DmaContext *pCtx, unsigned int fence)
+{
+	struct DmaJob *pJob;
+	unsigned long flags;
+	int retired = 1;
+	int count;
+
+	spin_lock_irqsave(&g_jobLock, flags);
+
+	//pick up anything which finished without interrupting
+	DmaServiceAll();
+
+	if (pCtx && fence == 0)
+		retired = atomic_read(&pCtx->m_queued) == 0;
+	else
+		//it's still going if it is queued on any channel, or its cache maintenance is still to be done
+		for (count = 0; count <= g_numChannels && retired; count++)
+		{
+			struct list_head *pQueue = count < g_numChannels ? &g_channels[count].m_jobQueue : &g_autoCacheJobs;
+
+			if (fence == 0)
+				retired = list_empty(pQueue);
+			else
+				list_for_each_entry(pJob, pQueue, m_list)
+					if (pJob->m_fence == fence)
+					{
+						retired = 0;
+						break;
+					}
+		}
+
+	DmaUnlockJobs(flags);
+
+	return retired;
+}
+
+//has one of the jobs being waited for been on the engine for longer than any should take
+//only the file's own jobs count, or with no file or fence, anyone's, as it's theirs that would be thrown away
+static int DmaStuck(struct DmaContext *pCtx, unsigned int fence)
+{
+	struct DmaJob *pJob;
+	unsigned long flags;
+	int stuck = 0;
+	int count;
+
+	spin_lock_irqsave(&g_jobLock, flags);
+
+	for (count = 0; count < g_numChannels && !stuck; count++)
+	{
+		struct list_head *pQueue = &g_channels[count].m_jobQueue;
+
+		if (list_empty(pQueue))
+			continue;
+
+		//those behind the head haven't had their turn yet
+		pJob = list_first_entry(pQueue, struct DmaJob, m_list);
+		if ((pJob->m_pCtx == pCtx || (fence && pJob->m_fence == fence) || (!pCtx && !fence))
+			&& pJob->m_started
+			&& time_after(jiffies, pJob->m_startTime + msecs_to_jiffies(DMA_WAIT_TIMEOUT_MS)))
+			stuck = 1;
+	}
+
+	DmaUnlockJobs(flags);
+
+	return stuck;
+}
+
+//queue up a prepared chain by the bus address of its first block
+//any pool blocks it uses belong to the job from here on, even if it cannot be queued
+//a chain in user memory gives the user address of its head, for its progress
+//it goes on *ppChannel if one is given, otherwise the least loaded, which is passed back
+//with pShared it joins that fence rather than being given a new one, giving it out too if it's the first
+//the submitter never waits for the job lock, if someone else has it they'll start the job
+static int DmaQueueJob(struct DmaContext *pCtx, dma_addr_t busHead, unsigned int jobFlags, unsigned int userData,
+		unsigned int poolFirst, unsigned int poolCount, struct DmaControlBlock __user *pUserHead, struct DmaChannel **ppChannel,
+		struct DmaSharedFence *pShared, unsigned int *pFence)
+{
+	struct DmaJob *pJob;
+	struct DmaChannel *pChannel;
+	unsigned long flags;
+	unsigned int fence;
+
+	pJob = (struct DmaJob *)kmalloc(sizeof(struct DmaJob), GFP_KERNEL);
+	if (!pJob)
+	{
+		PRINTK(KERN_ERR "couldn\'t allocate a job for cb %08lx\n", (unsigned long)busHead);
+		if (poolCount)
+			CbPoolFree(poolFirst, poolCount);
+		return 1;
+	}
+
+	pJob->m_busHead = busHead;
+	pJob->m_flags = jobFlags;
+	if (pCtx->m_autoCache && cpu_architecture() >= CPU_ARCH_ARMv7)
+		pJob->m_flags |= DMA_JOB_AUTO_CACHE;
+	pJob->m_userData = userData;
+	pJob->m_poolFirst = poolFirst;
+	pJob->m_poolCount = poolCount;
+	pJob->m_pUserHead = pUserHead;
+	pJob->m_started = 0;
+
+	//flush_cache_all();
+
+	if (ppChannel && *ppChannel)
+		pChannel = *ppChannel;
+	else
+		pChannel = DmaPickChannel();
+
+	if (ppChannel)
+		*ppChannel = pChannel;
+
+	//hand out the next fence, skipping zero
+	if (pShared && pShared->m_fence)
+		fence = pShared->m_fence;
+	else
+	{
+		do
+			fence = atomic_inc_return(&g_fenceIssued) & DMA_FENCE_MASK;
+		while (!fence);
+
+		if (pShared)
+			pShared->m_fence = fence;
+	}
+
+	if (pFence)
+		*pFence = fence;
+
+	//it can't retire before this job has
+	if (pShared)
+		atomic_inc(&pShared->m_refs);
+
+	pJob->m_fence = fence;
+	pJob->m_pShared = pShared;
+	pJob->m_pChannel = pChannel;
+	pJob->m_pCtx = pCtx;
+	pJob->m_kernCount = 0;
+	pJob->m_pKernCBs = DmaJobCBs(pJob, &pJob->m_kernCount);
+
+	//every kick, whatever prepared its blocks, and however long ago
+	if (pCtx->m_autoCache)
+		DmaAutoCacheJob(pJob, 0);
+
+	atomic_inc(&pChannel->m_queued);
+	atomic_inc(&pCtx->m_queued);
+
+	llist_add(&pJob->m_node, &pChannel->m_incoming);
+
+	//get it going now if nobody else is in there
+	if (spin_trylock_irqsave(&g_jobLock, flags))
+	{
+		DmaServiceAll();
+		DmaUnlockJobs(flags);
+	}
+	
+	return 0;
+}
+
+static int DmaKick(struct DmaContext *pCtx, struct DmaControlBlock __user *pUserCB, unsigned int jobFlags, unsigned int userData, unsigned int *pFence)
+{
+	void __iomem *pBusCB;
+	
+	pBusCB = UserVirtualToBusViaCbCache(pCtx, pUserCB);
+	if (!pBusCB)
+	{
+		PRINTK(KERN_ERR "virtual to bus translation failure for cb\n");
+		return 1;
+	}
+
+	return DmaQueueJob(pCtx, (dma_addr_t)pBusCB, jobFlags, userData, 0, 0, pUserCB, 0, 0, pFence);
+}
+
+//returns a fence, or a negative error
+static int DmaSubmitDescriptors(struct DmaContext *pCtx, struct DmaDescriptorList __user *pUserList)
+{
+	struct DmaDescriptorList list;
+	struct DmaDescriptor *pDescs;
+	struct DmaControlBlock kernCB, runCB;
+	unsigned int done, count, fence;
+	unsigned int used = 0;
+	int first;
+
+	if (copy_from_user(&list, pUserList, sizeof(list)) != 0)
+		return -EFAULT;
+
+	if (list.m_count == 0 || list.m_count > DMA_CB_POOL_SIZE)
+		return -EINVAL;
+
+	first = CbPoolAllocWait(list.m_count);
+	if (first < 0)
+		return -EBUSY;
+
+	pDescs = (struct DmaDescriptor *)kmalloc(DMA_DESC_CHUNK * sizeof(struct DmaDescriptor), GFP_KERNEL);
+	if (!pDescs)
+	{
+		CbPoolFree(first, list.m_count);
+		return -ENOMEM;
+	}
+
+#ifndef CONFIG_MMU_NOTIFIER
+	FlushAddrCache(pCtx);
+#endif
+
+	for (done = 0; done < list.m_count; done += count)
+	{
+		unsigned int i;
+
+		count = min(list.m_count - done, (unsigned int)DMA_DESC_CHUNK);
+
+		if (copy_from_user(pDescs, list.m_pDescriptors + done, count * sizeof(struct DmaDescriptor)) != 0)
+		{
+			kfree(pDescs);
+			CbPoolFree(first, list.m_count);
+			return -EFAULT;
+		}
+
+		for (i = 0; i < count; i++)
+		{
+			kernCB.m_transferInfo = pDescs[i].m_transferInfo;
+			kernCB.m_pSourceAddr = pDescs[i].m_pSourceAddr;
+			kernCB.m_pDestAddr = pDescs[i].m_pDestAddr;
+			kernCB.m_xferLen = pDescs[i].m_xferLen;
+			kernCB.m_tdStride = pDescs[i].m_tdStride;
+
+			if (DmaTranslateCB(pCtx, &kernCB))
+			{
+				kfree(pDescs);
+				CbPoolFree(first, list.m_count);
+				return -EINVAL;
+			}
+
+			kernCB.m_blank1 = kernCB.m_blank2 = 0;
+
+			//grow the current block if this one carries straight on from it
+			if (done + i > 0 && DmaCanMerge(&runCB, &kernCB, DmaMaxXferLen(0)))
+			{
+				runCB.m_xferLen += kernCB.m_xferLen;
+				continue;
+			}
+
+			//otherwise the current one is finished, link it to the next by bus address
+			//straight into coherent memory, nothing to flush
+			if (done + i > 0)
+			{
+				runCB.m_pNext = (struct DmaControlBlock *)CbPoolBus(first + used + 1);
+				g_pCbPool[first + used++] = runCB;
+			}
+
+			runCB = kernCB;
+		}
+	}
+
+	kfree(pDescs);
+
+	//the last one raises the interrupt
+	runCB.m_pNext = 0;
+	runCB.m_transferInfo |= DMA_TI_INTEN;
+	g_pCbPool[first + used++] = runCB;
+
+	//hand back what merging saved
+	if (used < list.m_count)
+		CbPoolFree(first + used, list.m_count - used);
+
+	//make sure the blocks have landed before the channel reads them
+	wmb();
+
+	if (DmaQueueJob(pCtx, CbPoolBus(first), 0, 0, first, used, 0, 0, 0, &fence))
+		return -ENOMEM;
+
+	return fence;
+}
+
+//move a batch of translated CBs into the pool, link them up and kick them on the given channel under the shared fence
+static int DmaQueuePoolCBs(struct DmaContext *pCtx, struct DmaControlBlock *pCBs, unsigned int count,
+		struct DmaChannel *pChannel, struct DmaSharedFence *pShared)
+{
+	unsigned int i;
+	int first;
+
+	first = CbPoolAllocWait(count);
+	if (first < 0)
+		return -EBUSY;
+
+	for (i = 0; i < count; i++)
+	{
+		if (i + 1 < count)
+			pCBs[i].m_pNext = (struct DmaControlBlock *)CbPoolBus(first + i + 1);
+		else
+		{
+			pCBs[i].m_pNext = 0;
+			pCBs[i].m_transferInfo |= DMA_TI_INTEN;
+		}
+
+		g_pCbPool[first + i] = pCBs[i];
+	}
+
+	wmb();
+
+	if (DmaQueueJob(pCtx, CbPoolBus(first), 0, 0, first, count, 0, &pChannel, pShared, 0))
+		return -ENOMEM;
+
+	return 0;
+}
+
+//how far from pUser the range stays physically contiguous, looking no further than length
+//pBus is the translation of pUser
+static unsigned long DmaContiguousSpan(struct DmaContext *pCtx, void __user *pUser, void __iomem *pBus, unsigned long length)
+{
+	unsigned long span = PAGE_SIZE - ((unsigned long)pUser & ~PAGE_MASK);
+
+	while (span < length
+			&& UserVirtualToBusViaCache(pCtx, pUser + span) == pBus + span)
+		span += PAGE_SIZE;
+
+	return min(span, length);
+}
+
+//build CBs for one user range, kicking them on the channel each time a batch fills up
+//*pUsed CBs are left in the batch for the caller to kick
+static int DmaBuildCopy(struct DmaContext *pCtx, struct DmaChannel *pChannel, void __user *pSource, void __user *pDest,
+		unsigned long remaining, unsigned int srcInc,
+		struct DmaControlBlock *pCBs, unsigned int *pUsed, struct DmaSharedFence *pShared)
+{
+	unsigned int maxLength = DmaMaxXferLen(pChannel);
+	unsigned int burst = DmaMaxBurst(pChannel);
+	unsigned int used = *pUsed;
+	int error = 0;
+
+	while (remaining)
+	{
+		void __iomem *pSourceBus, __iomem *pDestBus;
+		unsigned long length = min(remaining, (unsigned long)maxLength);
+
+		pSourceBus = UserVirtualToBusViaCache(pCtx, pSource);
+		pDestBus = UserVirtualToBusViaCache(pCtx, pDest);
+
+		if (!pSourceBus || !pDestBus)
+		{
+			PRINTK(KERN_ERR "virtual to bus translation failure for copy %p->%p\n", pSource, pDest);
+			error = -EINVAL;
+			break;
+		}
+
+		//cut the piece where either side stops being contiguous
+		length = DmaContiguousSpan(pCtx, pDest, pDestBus, length);
+		if (srcInc)
+			length = DmaContiguousSpan(pCtx, pSource, pSourceBus, length);
+
+		pCBs[used].m_transferInfo = DMA_TI_DEST_INC | DMA_TI_DEST_WIDTH | DMA_TI_SRC_WIDTH
+				| DMA_TI_BURST(burst) | (srcInc ? DMA_TI_SRC_INC : 0);
+		pCBs[used].m_pSourceAddr = pSourceBus;
+		pCBs[used].m_pDestAddr = pDestBus;
+		pCBs[used].m_xferLen = length;
+		pCBs[used].m_tdStride = 0;
+		pCBs[used].m_blank1 = pCBs[used].m_blank2 = 0;
+
+		if (srcInc)
+			pSource += length;
+		pDest += length;
+		remaining -= length;
+
+		//one copy may carry on physically from the last
+		if (used > 0 && DmaCanMerge(&pCBs[used - 1], &pCBs[used], maxLength))
+		{
+			pCBs[used - 1].m_xferLen += length;
+			continue;
+		}
+
+		//kick a full batch now, it can run while the rest is built
+		if (++used == DMA_COPY_BATCH)
+		{
+			error = DmaQueuePoolCBs(pCtx, pCBs, used, pChannel, pShared);
+			used = 0;
+			if (error)
+				break;
+		}
+	}
+
+	*pUsed = used;
+	return error;
+}
+
+//the share of a striped copy of this length to addr which ends at the given fraction of the total weight
+//cut where addr crosses a page boundary so the stripes don't add any more blocks than they need
+static unsigned long DmaStripePoint(unsigned long addr, unsigned long length, unsigned int weight, unsigned int total)
+{
+	unsigned long long point;
+	unsigned long boundary;
+
+	if (weight >= total)
+		return length;
+
+	point = (unsigned long long)length * weight;
+	do_div(point, total);
+
+	//no boundary before the point, so this stripe starts with nothing
+	boundary = (addr + (unsigned long)point) & PAGE_MASK;
+	if (boundary <= addr)
+		return 0;
+
+	return boundary - addr;
+}
+
+//returns non-zero if some page of the range doesn't translate
+static int DmaCheckRange(struct DmaContext *pCtx, void __user *pAddr, unsigned long length)
+{
+	unsigned long addr = (unsigned long)pAddr, end = addr + length;
+
+	if (end < addr)
+		return 1;
+
+	//one address in each page it touches
+	for (; addr < end; addr = (addr & PAGE_MASK) + PAGE_SIZE)
+		if (!UserVirtualToBusViaCache(pCtx, (void __user *)addr))
+			return 1;
+
+	return 0;
+}
+
+//returns a fence, or a negative error
+static int DmaSubmitCopies(struct DmaContext *pCtx, struct DmaCopyList __user *pUserList)
+{
+	struct DmaCopyList list;
+	struct DmaCopy *pCopies;
+	struct DmaControlBlock *pCBs;
+	struct DmaChannel *pMain;
+	struct DmaSharedFence *pShared;
+	unsigned long flags;
+	unsigned int count, used, fence;
+	unsigned int before = 0, total = 0;
+	int channel;
+	int error = 0;
+
+	if (copy_from_user(&list, pUserList, sizeof(list)) != 0)
+		return -EFAULT;
+
+	if (list.m_count == 0 || list.m_count > DMA_MAX_COPIES)
+		return -EINVAL;
+
+	pCopies = (struct DmaCopy *)kmalloc(list.m_count * sizeof(struct DmaCopy), GFP_KERNEL);
+	pCBs = (struct DmaControlBlock *)kmalloc(DMA_COPY_BATCH * sizeof(struct DmaControlBlock), GFP_KERNEL);
+	pShared = (struct DmaSharedFence *)kmalloc(sizeof(struct DmaSharedFence), GFP_KERNEL);
+
+	if (!pCopies || !pCBs || !pShared)
+	{
+		kfree(pCopies);
+		kfree(pCBs);
+		kfree(pShared);
+		return -ENOMEM;
+	}
+
+	if (copy_from_user(pCopies, list.m_pCopies, list.m_count * sizeof(struct DmaCopy)) != 0)
+	{
+		kfree(pCopies);
+		kfree(pCBs);
+		kfree(pShared);
+		return -EFAULT;
+	}
+
+	for (count = 0; count < list.m_count; count++)
+		if (pCopies[count].m_length == 0 || (pCopies[count].m_flags & ~DMA_COPY_FLAGS))
+		{
+			kfree(pCopies);
+			kfree(pCBs);
+			kfree(pShared);
+			return -EINVAL;
+		}
+
+#ifndef CONFIG_MMU_NOTIFIER
+	FlushAddrCache(pCtx);
+#endif
+
+	//a bad range fails the list before anything is kicked, rather than leaving some of it done
+	for (count = 0; count < list.m_count; count++)
+	{
+		struct DmaCopy *pCopy = &pCopies[count];
+		unsigned int srcInc = !(pCopy->m_flags & DMA_COPY_SRC_FIXED);
+
+		if (DmaCheckRange(pCtx, pCopy->m_pSourceAddr, srcInc ? pCopy->m_length : 1)
+				|| DmaCheckRange(pCtx, pCopy->m_pDestAddr, pCopy->m_length))
+		{
+			PRINTK(KERN_ERR "virtual to bus translation failure for copy %d, %p->%p\n",
+					count, pCopy->m_pSourceAddr, pCopy->m_pDestAddr);
+			kfree(pCopies);
+			kfree(pCBs);
+			kfree(pShared);
+			return -EINVAL;
+		}
+	}
+
+	//held until every batch is kicked, so the first ones finishing can't retire the fence while the rest are built
+	pShared->m_fence = 0;
+	atomic_set(&pShared->m_refs, 1);
+
+	//copies which aren't striped all go on the same channel, so they happen in order
+	pMain = DmaPickChannel();
+
+	for (channel = 0; channel < g_numChannels; channel++)
+		total += DmaMaxBurst(&g_channels[channel]);
+
+	//work through the channels in turn, giving each its share
+	//every job shares the first one's fence, so it covers the lot
+	for (channel = 0; channel < g_numChannels && !error; channel++)
+	{
+		struct DmaChannel *pChannel = &g_channels[channel];
+		unsigned int weight = DmaMaxBurst(pChannel);
+
+		used = 0;
+
+		for (count = 0; count < list.m_count && !error; count++)
+		{
+			struct DmaCopy *pCopy = &pCopies[count];
+			unsigned int srcInc = !(pCopy->m_flags & DMA_COPY_SRC_FIXED);
+			unsigned long start = 0, end = pCopy->m_length;
+
+			if ((pCopy->m_flags & DMA_COPY_STRIPE) && g_numChannels > 1)
+			{
+				//the destination always moves, so its pages are the ones to line up with
+				start = DmaStripePoint((unsigned long)pCopy->m_pDestAddr, pCopy->m_length, before, total);
+				end = DmaStripePoint((unsigned long)pCopy->m_pDestAddr, pCopy->m_length, before + weight, total);
+			}
+			else if (pChannel != pMain)
+				continue;
+
+			if (start >= end)
+				continue;
+
+			error = DmaBuildCopy(pCtx, pChannel,
+					srcInc ? pCopy->m_pSourceAddr + start : pCopy->m_pSourceAddr,
+					pCopy->m_pDestAddr + start,
+					end - start, srcInc,
+					pCBs, &used, pShared);
+		}
+
+		if (!error && used)
+			error = DmaQueuePoolCBs(pCtx, pCBs, used, pChannel, pShared);
+
+		before += weight;
+	}
+
+	kfree(pCopies);
+	kfree(pCBs);
+
+	//nothing more is going under the fence, it retires with the last job, or now if they're all done
+	spin_lock_irqsave(&g_jobLock, flags);
+	fence = pShared->m_fence;
+	DmaPutSharedFence(pCtx, pShared);
+	DmaUnlockJobs(flags);
+
+	//ran out of something part way, the caller has no fence for what was kicked so it has to be over when we return
+	if (error && fence)
+		DmaWait(pCtx, fence);
+
+	return error ? error : fence;
+}
+
+/****** PERSISTENT CHAINS ******/
+//let go of the pins the engine can no longer be using
+static void ChainFreeOldPins(struct DmaChain *pChain)
+{
+	struct DmaFixedBuffer *pPin;
+
+	while (pChain->m_pOldPins)
+	{
+		pPin = pChain->m_pOldPins;
+		pChain->m_pOldPins = pPin->m_pNext;
+		FreeFixedBuffer(pPin, pPin->m_numPages);
+	}
+}
+
+//let go of the replaced pins of every block the engine isn't on right now
+//it loads a block afresh each time round, so once it's off one it has finished with what the block used to say
+static void ChainFreePassedPins(struct DmaChain *pChain)
+{
+	struct DmaFixedBuffer **ppPin = &pChain->m_pOldPins, *pPin;
+	unsigned int conblk = readl(pChain->m_pCycleBase + DMA_REG_CONBLK_AD);
+
+	while ((pPin = *ppPin))
+	{
+		if (conblk != pChain->m_busCBs + pPin->m_oldBlock * sizeof(struct DmaControlBlock))
+		{
+			*ppPin = pPin->m_pNext;
+			FreeFixedBuffer(pPin, pPin->m_numPages);
+		}
+		else
+			ppPin = &pPin->m_pNext;
+	}
+}
+
+//a block's pages are no longer needed, though a cycling chain could still be reading the block that had them
+static void ChainUnpin(struct DmaChain *pChain, unsigned int index, struct DmaFixedBuffer *pPin)
+{
+	if (!pPin)
+		return;
+
+	if (pChain->m_pCycleBase)
+	{
+		pPin->m_oldBlock = index;
+		pPin->m_pNext = pChain->m_pOldPins;
+		pChain->m_pOldPins = pPin;
+	}
+	else
+		FreeFixedBuffer(pPin, pPin->m_numPages);
+}
+
+static void FreeChain(struct DmaChain *pChain)
+{
+	unsigned int count;
+
+	if (pChain->m_pCBs)
+		dma_free_coherent(0, pChain->m_numCBs * sizeof(struct DmaControlBlock), pChain->m_pCBs, pChain->m_busCBs);
+
+	if (pChain->m_ppPins)
+		for (count = 0; count < pChain->m_numCBs * 2; count++)
+			if (pChain->m_ppPins[count])
+				FreeFixedBuffer(pChain->m_ppPins[count], pChain->m_ppPins[count]->m_numPages);
+	ChainFreeOldPins(pChain);
+
+	vfree(pChain->m_ppPins);
+	vfree(pChain->m_ppUserCBs);
+	kfree(pChain);
+}
+
+//pin the user range one side of a CB covers, so it can't be freed, reclaimed or moved while the chain is registered
+//returns zero with no error if there is nothing to pin
+static struct DmaFixedBuffer *ChainPinSide(struct DmaContext *pCtx, struct DmaControlBlock *pCB, void __user *pAddr,
+		unsigned int inc, short stride, int write, int *pError)
+{
+	unsigned long start = (unsigned long)pAddr, end = start + 16;
+	unsigned int xlen = pCB->m_xferLen, rows = 1;
+	unsigned long last;
+
+	*pError = 0;
+
+	//passed straight through to physical memory
+	if (pAddr >= pCtx->m_pMinPhys && pAddr < pCtx->m_pMaxPhys)
+		return 0;
+
+	//a fixed address is one word, at most 128 bits, otherwise every row, which a negative stride walks backwards
+	if (pCB->m_transferInfo & inc)
+	{
+		if (pCB->m_transferInfo & DMA_TI_TDMODE)
+		{
+			xlen = pCB->m_xferLen & 0xffff;
+			rows = max(pCB->m_xferLen >> 16, 1U);
+		}
+
+		last = start + (long)(rows - 1) * ((long)xlen + stride);
+		end = max(start, last) + xlen;
+		start = min(start, last);
+	}
+
+	return PinUserRange(start, end - start, write, pError);
+}
+
+//the translation has to have found the pinned page, else the mapping changed in the meantime
+static inline int ChainPinHolds(struct DmaFixedBuffer *pPin, void __user *pAddr, void __iomem *pBus)
+{
+	unsigned long page;
+
+	if (!pPin)
+		return 1;
+
+	page = ((unsigned long)pAddr >> PAGE_SHIFT) - (pPin->m_start >> PAGE_SHIFT);
+	return pPin->m_pBusPages[page] == ((unsigned long)pBus & ~4095);
+}
+
+//(re-)read CBs [first, first + count) from user space and translate them into the chain
+//the links between blocks are the module's own and aren't taken from user space
+static int ChainPrepareRange(struct DmaContext *pCtx, struct DmaChain *pChain, unsigned int first, unsigned int count)
+{
+	unsigned int index;
+
+	for (index = first; index < first + count; index++)
+	{
+		struct DmaControlBlock kernCB;
+		struct DmaFixedBuffer *pSourcePin, *pDestPin = 0;
+		void __user *pSource, *pDest;
+		int error;
+
+		if (copy_from_user(&kernCB, pChain->m_ppUserCBs[index], sizeof(struct DmaControlBlock)) != 0)
+		{
+			PRINTK(KERN_ERR "copy_from_user failed for user cb %p\n", pChain->m_ppUserCBs[index]);
+			return 1;
+		}
+
+		//pinned before translating, so the translation finds the pages that are held
+		pSource = kernCB.m_pSourceAddr;
+		pDest = kernCB.m_pDestAddr;
+		pSourcePin = ChainPinSide(pCtx, &kernCB, pSource, DMA_TI_SRC_INC, (short)(kernCB.m_tdStride & 0xffff), 0, &error);
+		if (!error)
+			pDestPin = ChainPinSide(pCtx, &kernCB, pDest, DMA_TI_DEST_INC, (short)(kernCB.m_tdStride >> 16), 1, &error);
+
+		if (error || DmaTranslateCB(pCtx, &kernCB)
+			|| !ChainPinHolds(pSourcePin, pSource, kernCB.m_pSourceAddr)
+			|| !ChainPinHolds(pDestPin, pDest, kernCB.m_pDestAddr))
+		{
+			PRINTK(KERN_ERR "failed to prepare cb %d of chain\n", index);
+
+			//the block and its pins are left as they were
+			if (pSourcePin)
+				FreeFixedBuffer(pSourcePin, pSourcePin->m_numPages);
+			if (pDestPin)
+				FreeFixedBuffer(pDestPin, pDestPin->m_numPages);
+			return 1;
+		}
+
+		if (index == pChain->m_numCBs - 1 && pChain->m_pCycleBase)
+			//back round to the start, nobody to interrupt as it never retires
+			kernCB.m_pNext = (struct DmaControlBlock *)pChain->m_busCBs;
+		else if (index == pChain->m_numCBs - 1)
+		{
+			kernCB.m_pNext = 0;
+			kernCB.m_transferInfo |= DMA_TI_INTEN;
+		}
+		else
+			kernCB.m_pNext = (struct DmaControlBlock *)(pChain->m_busCBs + (index + 1) * sizeof(struct DmaControlBlock));
+
+		pChain->m_pCBs[index] = kernCB;
+
+		ChainUnpin(pChain, index, pChain->m_ppPins[index * 2]);
+		ChainUnpin(pChain, index, pChain->m_ppPins[index * 2 + 1]);
+		pChain->m_ppPins[index * 2] = pSourcePin;
+		pChain->m_ppPins[index * 2 + 1] = pDestPin;
+	}
+
+	return 0;
+}
+
+//returns the chain id, or a negative error
+static int ChainRegister(struct DmaContext *pCtx, struct DmaControlBlock __user *pUserCB)
+{
+	struct DmaChain *pChain;
+	struct DmaControlBlock __user *pUCB;
+	unsigned int count = 0;
+	int id = -ENOSPC;
+
+	//count it first
+	for (pUCB = pUserCB; pUCB; count++)
+	{
+		if (count == DMA_MAX_CHAIN_CBS)
+		{
+			PRINTK(KERN_ERR "chain at %p is too long or loops\n", pUserCB);
+			return -E2BIG;
+		}
+
+		if (get_user(pUCB, &pUCB->m_pNext))
+			return -EFAULT;
+	}
+
+	if (!count)
+		return -EINVAL;
+
+	pChain = (struct DmaChain *)kzalloc(sizeof(struct DmaChain), GFP_KERNEL);
+	if (!pChain)
+		return -ENOMEM;
+
+	pChain->m_numCBs = count;
+	pChain->m_ppUserCBs = (struct DmaControlBlock __user **)vmalloc(count * sizeof(struct DmaControlBlock __user *));
+	pChain->m_ppPins = (struct DmaFixedBuffer **)vzalloc(count * 2 * sizeof(struct DmaFixedBuffer *));
+	pChain->m_pCBs = (struct DmaControlBlock *)dma_alloc_coherent(0, count * sizeof(struct DmaControlBlock), &pChain->m_busCBs, GFP_KERNEL);
+
+	if (!pChain->m_ppUserCBs || !pChain->m_ppPins || !pChain->m_pCBs)
+	{
+		PRINTK(KERN_ERR "couldn\'t allocate a chain of %d cbs\n", count);
+		FreeChain(pChain);
+		return -ENOMEM;
+	}
+
+	//then remember where each block lives, as the user chain can change under us
+	for (pUCB = pUserCB, count = 0; count < pChain->m_numCBs; count++)
+	{
+		pChain->m_ppUserCBs[count] = pUCB;
+		if (get_user(pUCB, &pUCB->m_pNext))
+		{
+			FreeChain(pChain);
+			return -EFAULT;
+		}
+	}
+
+	if (ChainPrepareRange(pCtx, pChain, 0, pChain->m_numCBs))
+	{
+		FreeChain(pChain);
+		return -EINVAL;
+	}
+
+	mutex_lock(&pCtx->m_chainLock);
+	for (count = 0; count < DMA_MAX_CHAINS; count++)
+		if (!pCtx->m_pChains[count])
+		{
+			pCtx->m_pChains[count] = pChain;
+			id = count + 1;
+			break;
+		}
+	mutex_unlock(&pCtx->m_chainLock);
+
+	if (id < 0)
+	{
+		PRINTK(KERN_ERR "too many registered chains\n");
+		FreeChain(pChain);
+		return id;
+	}
+
+	PRINTK_VERBOSE(KERN_DEBUG "registered chain %d of %d cbs at bus %08lx\n", id, pChain->m_numCBs, (unsigned long)pChain->m_busCBs);
+
+	return id;
+}
+
+//must be called with the chain lock held
+static inline struct DmaChain *ChainLookup(struct DmaContext *pCtx, unsigned long id)
+{
+	if (id < 1 || id > DMA_MAX_CHAINS)
+		return 0;
+
+	return pCtx->m_pChains[id - 1];
+}
+
+//returns a fence, or a negative error
+static int ChainKick(struct DmaContext *pCtx, unsigned long id)
+{
+	struct DmaChain *pChain;
+	unsigned int fence;
+	int result = -EINVAL;
+
+	mutex_lock(&pCtx->m_chainLock);
+
+	pChain = ChainLookup(pCtx, id);
+	if (pChain && pChain->m_pCycleBase)
+		result = -EBUSY;
+	else if (pChain)
+	{
+		//make sure the blocks have landed before the channel reads them
+		wmb();
+
+		if (DmaQueueJob(pCtx, pChain->m_busCBs, 0, 0, 0, 0, 0, &pChain->m_pChannel, 0, &fence) == 0)
+		{
+			pChain->m_lastFence = fence;
+			result = fence;
+		}
+		else
+			result = -ENOMEM;
+	}
+
+	mutex_unlock(&pCtx->m_chainLock);
+
+	return result;
+}
+
+static int ChainUpdate(struct DmaContext *pCtx, struct DmaChainUpdate __user *pUserUpdate)
+{
+	struct DmaChainUpdate update;
+	struct DmaChain *pChain;
+	int result = -EINVAL;
+
+	if (copy_from_user(&update, pUserUpdate, sizeof(update)) != 0)
+		return -EFAULT;
+
+	mutex_lock(&pCtx->m_chainLock);
+
+	pChain = ChainLookup(pCtx, update.m_id);
+	if (pChain && update.m_first < pChain->m_numCBs && update.m_count <= pChain->m_numCBs - update.m_first)
+	{
+		//can't rewrite it while the channel may be reading it, unless it's cycling, when that's up to user space
+		if (pChain->m_pCycleBase)
+		{
+			//a chain streaming for good is updated for good, so what it's moved past can't wait for it to stop
+			ChainFreePassedPins(pChain);
+			result = ChainPrepareRange(pCtx, pChain, update.m_first, update.m_count) ? -EINVAL : 0;
+			wmb();
+		}
+		else if (pChain->m_lastFence && DmaWait(pCtx, pChain->m_lastFence))
+			result = -ETIMEDOUT;
+		else
+			result = ChainPrepareRange(pCtx, pChain, update.m_first, update.m_count) ? -EINVAL : 0;
+	}
+
+	mutex_unlock(&pCtx->m_chainLock);
+
+	return result;
+}
+
+//user blocks in a cycling chain may still ask to interrupt, nobody retires anything so just acknowledge them
+static irqreturn_t ChainCycleIrq(int irq, void *pDevId)
+{
+	struct DmaChain *pChain = (struct DmaChain *)pDevId;
+	unsigned int cs = readl(pChain->m_pCycleBase + DMA_REG_CS);
+
+	//the line may be shared with other channels
+	if (!(cs & DMA_CS_INT))
+		return IRQ_NONE;
+
+	//nothing else ever pauses this channel, so it can be kept active without the job lock
+	writel(DMA_CS_INT | DMA_CS_ACTIVE, pChain->m_pCycleBase + DMA_REG_CS);
+
+	return IRQ_HANDLED;
+}
+
+//put the last CB back as it was and give up the channel
+//must be called with the chain lock held, or with the chain no longer reachable
+static void ChainStopCycle(struct DmaChain *pChain)
+{
+	struct DmaControlBlock *pLast = &pChain->m_pCBs[pChain->m_numCBs - 1];
+
+	//stopped before the handler goes, so nothing is left to interrupt
+	writel(DMA_CS_RESET, pChain->m_pCycleBase + DMA_REG_CS);
+	free_irq(pChain->m_cycleIrq, pChain);
+	bcm_dma_chan_free(pChain->m_cycleChan);
+	pChain->m_pCycleBase = 0;
+
+	//the engine has stopped, so nothing reads the blocks that were replaced while it ran
+	ChainFreeOldPins(pChain);
+
+	pLast->m_pNext = 0;
+	pLast->m_transferInfo |= DMA_TI_INTEN;
+}
+
+//start a registered chain looping on a channel of its own
+static int ChainCycle(struct DmaContext *pCtx, unsigned long id)
+{
+	struct DmaChain *pChain;
+	struct DmaControlBlock *pLast;
+	int result = 0;
+
+	mutex_lock(&pCtx->m_chainLock);
+
+	pChain = ChainLookup(pCtx, id);
+	if (!pChain)
+		result = -EINVAL;
+	else if (pChain->m_pCycleBase)
+		result = -EBUSY;
+	//the blocks are about to change, so any kick has to be out of the way
+	else if (pChain->m_lastFence && DmaWait(pCtx, pChain->m_lastFence))
+		result = -ETIMEDOUT;
+	else
+	{
+		pChain->m_cycleChan = bcm_dma_chan_alloc(BCM_DMA_FEATURE_FAST, (void **)&pChain->m_pCycleBase, &pChain->m_cycleIrq);
+		if (pChain->m_cycleChan < 0)
+		{
+			PRINTK(KERN_ERR "no dma channel free to cycle chain %ld\n", id);
+			pChain->m_pCycleBase = 0;
+			result = -EBUSY;
+		}
+		//any of the user's blocks may interrupt, which has to be acknowledged
+		else if (request_irq(pChain->m_cycleIrq, ChainCycleIrq, IRQF_SHARED, "dmaer cycle", pChain))
+		{
+			PRINTK(KERN_ERR "couldn\'t get irq %d to cycle chain %ld\n", pChain->m_cycleIrq, id);
+			bcm_dma_chan_free(pChain->m_cycleChan);
+			pChain->m_pCycleBase = 0;
+			result = -EBUSY;
+		}
+	}
+
+	if (!result)
+	{
+		pLast = &pChain->m_pCBs[pChain->m_numCBs - 1];
+		pLast->m_pNext = (struct DmaControlBlock *)pChain->m_busCBs;
+		pLast->m_transferInfo &= ~DMA_TI_INTEN;
+		wmb();
+
+		PRINTK_VERBOSE(KERN_DEBUG "cycling chain %ld on dma channel %d\n", id, pChain->m_cycleChan);
+		writel(DMA_CS_RESET, pChain->m_pCycleBase + DMA_REG_CS);
+		bcm_dma_start(pChain->m_pCycleBase, pChain->m_busCBs);
+	}
+
+	mutex_unlock(&pCtx->m_chainLock);
+
+	return result;
+}
+
+//returns the index of the CB the engine is on, or a negative error
+static int ChainPosition(struct DmaContext *pCtx, unsigned long id)
+{
+	struct DmaChain *pChain;
+	unsigned long conblk;
+	int result = -EINVAL;
+
+	mutex_lock(&pCtx->m_chainLock);
+
+	pChain = ChainLookup(pCtx, id);
+	if (pChain && pChain->m_pCycleBase)
+	{
+		conblk = readl(pChain->m_pCycleBase + DMA_REG_CONBLK_AD);
+
+		if (conblk >= pChain->m_busCBs && conblk < pChain->m_busCBs + pChain->m_numCBs * sizeof(struct DmaControlBlock))
+			result = (conblk - pChain->m_busCBs) / sizeof(struct DmaControlBlock);
+		else
+			//it should never leave the ring
+			result = -EIO;
 	}
-	
-	//write it back to user space
-	if (copy_to_user(pUserCB, &kernCB, sizeof(struct DmaControlBlock)) != 0)
+
+	mutex_unlock(&pCtx->m_chainLock);
+
+	return result;
+}
+
+static int ChainStop(struct DmaContext *pCtx, unsigned long id)
+{
+	struct DmaChain *pChain;
+	int result = -EINVAL;
+
+	mutex_lock(&pCtx->m_chainLock);
+
+	pChain = ChainLookup(pCtx, id);
+	if (pChain && pChain->m_pCycleBase)
 	{
-		PRINTK(KERN_ERR "copy_to_user failed for cb %p\n", pUserCB);
-		*pError = 1;
-		return 0;
+		ChainStopCycle(pChain);
+		result = 0;
 	}
 
-	__cpuc_flush_dcache_area(pUserCB, 32);
+	mutex_unlock(&pCtx->m_chainLock);
 
-	*pError = 0;
-	return pUNext;
+	return result;
 }
 
-static int DmaKick(struct DmaControlBlock __user *pUserCB)
+static int ChainUnregister(struct DmaContext *pCtx, unsigned long id)
 {
-	void __iomem *pBusCB;
-	
-	pBusCB = UserVirtualToBusViaCbCache(pUserCB);
-	if (!pBusCB)
+	struct DmaChain *pChain;
+
+	mutex_lock(&pCtx->m_chainLock);
+
+	pChain = ChainLookup(pCtx, id);
+	if (pChain)
+		pCtx->m_pChains[id - 1] = 0;
+
+	mutex_unlock(&pCtx->m_chainLock);
+
+	if (!pChain)
+		return -EINVAL;
+
+	if (pChain->m_pCycleBase)
+		ChainStopCycle(pChain);
+
+	if (pChain->m_lastFence && DmaWait(pCtx, pChain->m_lastFence))
 	{
-		PRINTK(KERN_ERR "virtual to bus translation failure for cb\n");
-		return 1;
+		//it's stuck, the memory can't be freed while the channel could still be using it
+		DmaAbortCtx(pCtx);
 	}
 
-	//flush_cache_all();
+	FreeChain(pChain);
 
-	bcm_dma_start(g_pDmaChanBase, (dma_addr_t)pBusCB);
-	
 	return 0;
 }
 
-static void DmaWaitAll(void)
+//take everything user space has posted to the submission ring, preparing and kicking each chain
+//returns the number of entries consumed
+static int DmaRingEnter(struct DmaContext *pCtx)
+{
+	struct DmaSubmission sub;
+	unsigned int head, tail;
+	unsigned long flags;
+	int consumed = 0;
+
+	head = pCtx->m_pRings->m_subHead;
+	tail = ACCESS_ONCE(pCtx->m_pRings->m_subTail);
+
+	//don't trust the tail beyond one ring's worth
+	if (tail - head > DMA_RING_SUB_ENTRIES)
+	{
+		PRINTK(KERN_ERR "submission ring tail %d is too far ahead of head %d\n", tail, head);
+		return -EINVAL;
+	}
+
+	//read the entries after the tail
+	smp_rmb();
+
+	while (head != tail)
+	{
+		unsigned int fence;
+
+		//take a copy as user space can still write to it
+		sub = pCtx->m_pRings->m_sub[head & (DMA_RING_SUB_ENTRIES - 1)];
+
+		if (((sub.m_flags & DMA_SUBMIT_PREPARE) && DmaPrepareChain(pCtx, sub.m_pCB))
+			|| DmaKick(pCtx, sub.m_pCB, DMA_JOB_RING, sub.m_userData, &fence))
+		{
+			//report the failure in order with everything else
+			spin_lock_irqsave(&g_jobLock, flags);
+			DmaPostCompletion(pCtx, sub.m_userData, 0, -EINVAL);
+			DmaUnlockJobs(flags);
+		}
+
+		head++;
+		consumed++;
+	}
+
+	//let user space reuse the entries
+	smp_mb();
+	pCtx->m_pRings->m_subHead = head;
+
+	return consumed;
+}
+
+//wait for the chain with the given fence to retire, or everything kicked so far if the fence is zero
+//returns non-zero if that did not happen in time
+static int DmaWait(struct DmaContext *pCtx, unsigned int fence)
 {
 	int counter = 0;
-	volatile int inner_count;
-	volatile unsigned int cs;
 	unsigned long time_before, time_after;
+	int timed_out = 0;
 
 	time_before = jiffies;
-	//bcm_dma_wait_idle(g_pDmaChanBase);
 	dsb();
 	
-	cs = readl(g_pDmaChanBase);
-	
-	while ((cs & 1) == 1)
+	//short chains are often done before it is worth going to sleep, so poll for a little while first
+	while (!DmaRetired(pCtx, fence) && counter < DMA_WAIT_SPIN_COUNT)
 	{
-		cs = readl(g_pDmaChanBase);
 		counter++;
+		cpu_relax();
+	}
 
-		for (inner_count = 0; inner_count < 32; inner_count++);
+	//then sleep until the interrupt handler sees the end of the chain
+	//however long it is queued behind others, it only times out once it has been running too long itself
+	while (!DmaRetired(pCtx, fence))
+	{
+		//wake up now and again to check by hand, in case a chain was kicked without an interrupting last block
+		wait_event_timeout(g_dmaWaitQueue, DmaRetired(pCtx, fence), msecs_to_jiffies(DMA_WAIT_SLICE_MS));
 
-		asm volatile ("MCR p15,0,r0,c7,c0,4 \n");
-		//cpu_do_idle();
-		if (counter >= 1000000)
+		if (DmaStuck(pCtx, fence) && !DmaRetired(pCtx, fence))
 		{
 			PRINTK(KERN_WARNING "DMA failed to finish in a timely fashion\n");
+			timed_out = 1;
 			break;
 		}
+
+		//a chain of someone else's which never ends would keep us here for good
+		DmaAbortHogs();
 	}
 	time_after = jiffies;
-	PRINTK_VERBOSE(KERN_DEBUG "done, counter %d, cs %08x", counter, cs);
+	PRINTK_VERBOSE(KERN_DEBUG "done, fence %d, counter %d", fence, counter);
 	PRINTK_VERBOSE(KERN_DEBUG "took %ld jiffies, %d HZ\n", time_after - time_before, HZ);
+
+	return timed_out;
+}
+
+static void DmaWaitAll(struct DmaContext *pCtx)
+{
+	//callers are about to reuse or free the memory, so don't leave a stuck chain running
+	if (DmaWait(pCtx, 0))
+		DmaAbortCtx(pCtx);
+}
+
+//the bytes a CB moves, with a 2d transfer being ylength rows of xlength
+static inline unsigned int DmaCbBytes(struct DmaControlBlock *pCB)
+{
+	if (pCB->m_transferInfo & DMA_TI_TDMODE)
+		return (pCB->m_xferLen & 0xffff) * (pCB->m_xferLen >> 16);
+
+	return pCB->m_xferLen;
+}
+
+//find where a job's CBs are in kernel memory, if they are there and the module owns them
+//must be called with the chain lock held
+static struct DmaControlBlock *DmaJobCBs(struct DmaJob *pJob, unsigned int *pCount)
+{
+	int count;
+
+	if (pJob->m_poolCount)
+	{
+		*pCount = pJob->m_poolCount;
+		return &g_pCbPool[pJob->m_poolFirst];
+	}
+
+	//user memory can go at any time, so it is only read through pages the caller has pinned
+	if (pJob->m_pUserHead)
+		return 0;
+
+	for (count = 0; count < DMA_MAX_CHAINS; count++)
+	{
+		struct DmaChain *pChain = pJob->m_pCtx->m_pChains[count];
+
+		if (pChain && pChain->m_busCBs == pJob->m_busHead)
+		{
+			*pCount = pChain->m_numCBs;
+			return pChain->m_pCBs;
+		}
+	}
+
+	return 0;
+}
+
+//follow a job's blocks from its head as the engine does, as a prepared array may have folded some into others
+//counting those it runs before it gets to conblk and the bytes they move
+//returns how many it runs in all, stopping at the end of the chain or wherever it leaves the blocks we can see
+static unsigned int DmaWalkCBs(struct DmaJob *pJob, struct DmaControlBlock *pCBs, unsigned int numCBs,
+		unsigned int conblk, unsigned int *pDone, unsigned int *pBytes)
+{
+	unsigned long bus = pJob->m_busHead;
+	unsigned int index, total = 0;
+	int reached = 0;
+
+	*pDone = *pBytes = 0;
+
+	//a cycling chain never ends, so no more steps than blocks
+	while (total < numCBs && bus >= pJob->m_busHead && bus < pJob->m_busHead + numCBs * sizeof(struct DmaControlBlock))
+	{
+		index = (bus - pJob->m_busHead) / sizeof(struct DmaControlBlock);
+
+		if (bus == conblk)
+			reached = 1;
+
+		if (!reached)
+		{
+			(*pDone)++;
+			*pBytes += DmaCbBytes(&pCBs[index]);
+		}
+
+		total++;
+		bus = (unsigned long)pCBs[index].m_pNext;
+	}
+
+	return total;
+}
+
+//how many blocks of a pinned piece of a prepared array, from the first, the engine finds one after another
+//blocks are aligned so never straddle a page, the rest of its page is there, then each page which carries straight on
+//returns zero if the first isn't where the chain's head is any more
+static unsigned int DmaArrayContiguous(struct DmaFixedBuffer *pPin, dma_addr_t busHead, unsigned int remaining)
+{
+	unsigned int count, page;
+
+	if (pPin->m_pBusPages[0] + offset_in_page(pPin->m_start) != busHead)
+		return 0;
+
+	count = min(remaining, (unsigned int)((PAGE_SIZE - offset_in_page(pPin->m_start)) / sizeof(struct DmaControlBlock)));
+	for (page = 1; count < remaining && pPin->m_pBusPages[page] == pPin->m_pBusPages[0] + page * PAGE_SIZE; page++)
+		count = min(remaining, count + (unsigned int)(PAGE_SIZE / sizeof(struct DmaControlBlock)));
+
+	return count;
+}
+
+//pin what follows a chain's head in the last prepared array, if that's where it was kicked from
+//only done when progress is asked for, as kicking has to stay cheap
+//returns zero if there is nothing to read, otherwise the pin, the blocks it holds in a run and the chain's head
+static struct DmaFixedBuffer *DmaProgressPin(struct DmaContext *pCtx, unsigned int fence,
+		unsigned int *pCount, dma_addr_t *pBusHead)
+{
+	struct DmaControlBlock __user *pArray = pCtx->m_pArrayCBs;
+	struct DmaControlBlock __user *pUserHead = 0;
+	struct DmaFixedBuffer *pPin;
+	struct DmaJob *pJob;
+	unsigned long flags, offset;
+	unsigned int remaining;
+	int count, error;
+
+	spin_lock_irqsave(&g_jobLock, flags);
+	for (count = 0; count < g_numChannels && !pUserHead; count++)
+		list_for_each_entry(pJob, &g_channels[count].m_jobQueue, m_list)
+			if (pJob->m_fence == fence && pJob->m_pCtx == pCtx && pJob->m_pUserHead)
+			{
+				pUserHead = pJob->m_pUserHead;
+				*pBusHead = pJob->m_busHead;
+				break;
+			}
+	DmaUnlockJobs(flags);
+
+	offset = (unsigned long)pUserHead - (unsigned long)pArray;
+	if (!pUserHead || !pArray || pUserHead < pArray || (offset % sizeof(struct DmaControlBlock))
+		|| offset / sizeof(struct DmaControlBlock) >= pCtx->m_arrayCount)
+		return 0;
+
+	remaining = pCtx->m_arrayCount - offset / sizeof(struct DmaControlBlock);
+
+	pPin = PinUserRange((unsigned long)pUserHead, remaining * sizeof(struct DmaControlBlock), 0, &error);
+	if (!pPin)
+		return 0;
+
+	*pCount = DmaArrayContiguous(pPin, *pBusHead, remaining);
+	if (!*pCount)
+	{
+		FreeFixedBuffer(pPin, pPin->m_numPages);
+		return 0;
+	}
+
+	return pPin;
+}
+
+static int DmaGetProgress(struct DmaContext *pCtx, struct DmaProgress __user *pUserProgress)
+{
+	struct DmaProgress progress;
+	struct DmaFixedBuffer *pPin;
+	struct DmaJob *pJob;
+	dma_addr_t userBus = 0;
+	unsigned long flags;
+	unsigned int userCount = 0;
+	int count;
+
+	if (copy_from_user(&progress, pUserProgress, sizeof(progress)) != 0)
+		return -EFAULT;
+
+	if (!DmaFenceIssued(progress.m_fence))
+		return -EINVAL;
+
+	progress.m_done = 1;
+	progress.m_cbsDone = progress.m_cbsTotal = progress.m_bytesDone = progress.m_busCB = 0;
+
+	//pinned before the locks are taken, and held until we're done reading through it
+	pPin = DmaProgressPin(pCtx, progress.m_fence, &userCount, &userBus);
+
+	//so persistent chains stay put while we look at them
+	mutex_lock(&pCtx->m_chainLock);
+	spin_lock_irqsave(&g_jobLock, flags);
+
+	//anything finished shouldn't count as running
+	DmaServiceAll();
+
+	for (count = 0; count < g_numChannels; count++)
+	{
+		struct DmaChannel *pChannel = &g_channels[count];
+
+		list_for_each_entry(pJob, &pChannel->m_jobQueue, m_list)
+		{
+			struct DmaControlBlock *pCBs;
+			unsigned int numCBs = 0, current_cb, conblk = 0, done, bytes;
+
+			if (pJob->m_fence != progress.m_fence || pJob->m_pCtx != pCtx)
+				continue;
+
+			progress.m_done = 0;
+			pCBs = DmaJobCBs(pJob, &numCBs);
+
+			//the pages stay put while pinned, and the kernel's linear map is as contiguous as they are
+			if (pJob->m_pUserHead && pPin && pJob->m_busHead == userBus)
+			{
+				pCBs = (struct DmaControlBlock *)(page_address(pPin->m_ppPages[0]) + offset_in_page(pPin->m_start));
+				numCBs = userCount;
+			}
+
+			if (pJob->m_started)
+				conblk = readl(pChannel->m_pBase + DMA_REG_CONBLK_AD);
+
+			if (pCBs)
+				progress.m_cbsTotal += DmaWalkCBs(pJob, pCBs, numCBs, conblk, &done, &bytes);
+
+			if (!pJob->m_started)
+				continue;
+
+			//the head is running, those linked behind it may not have been reached
+			if (pCBs && conblk >= pJob->m_busHead && conblk < pJob->m_busHead + numCBs * sizeof(struct DmaControlBlock))
+			{
+				current_cb = (conblk - pJob->m_busHead) / sizeof(struct DmaControlBlock);
+
+				progress.m_cbsDone += done;
+				progress.m_bytesDone += bytes;
+
+				//and whatever the current one has got through, counted down in the register
+				if (!(pCBs[current_cb].m_transferInfo & DMA_TI_TDMODE))
+					progress.m_bytesDone += pCBs[current_cb].m_xferLen - readl(pChannel->m_pBase + DMA_REG_TXFR_LEN);
+
+				progress.m_busCB = conblk;
+			}
+			else if (&pJob->m_list == pChannel->m_jobQueue.next)
+				progress.m_busCB = conblk;
+		}
+	}
+
+	DmaUnlockJobs(flags);
+	mutex_unlock(&pCtx->m_chainLock);
+
+	if (pPin)
+		FreeFixedBuffer(pPin, pPin->m_numPages);
+
+	if (copy_to_user(pUserProgress, &progress, sizeof(progress)) != 0)
+		return -EFAULT;
+
+	return 0;
+}
+
+//forget the links made behind a job, so the jobs after it are started one at a time
+//must be called with the job lock held and the engine stopped or paused
+static void DmaUnlinkAfter(struct DmaChannel *pChannel, struct DmaJob *pJob)
+{
+	list_for_each_entry_from(pJob, &pChannel->m_jobQueue, m_list)
+	{
+		if (pJob->m_poolCount)
+			g_pCbPool[pJob->m_poolFirst + pJob->m_poolCount - 1].m_pNext = 0;
+
+		//every link was made to a job which was started
+		if (!pJob->m_started)
+			break;
+	}
+
+	wmb();
+}
+
+//take a file's jobs off one channel, stopping the engine only if it is on one of them
+//must be called with the job lock held
+static void DmaAbortCtxChannel(struct DmaChannel *pChannel, struct DmaContext *pCtx)
+{
+	struct list_head *pQueue = &pChannel->m_jobQueue;
+	struct DmaJob *pJob, *pNext, *pHead;
+	unsigned int cs, conblk;
+	int ours = 0, linked = 0, restart = 0;
+
+	//anything still in flight from a submitter, and anything finished, first
+	DmaTakeIncoming(pChannel);
+
+	list_for_each_entry(pJob, pQueue, m_list)
+		if (pJob->m_pCtx == pCtx)
+		{
+			ours = 1;
+			linked |= pJob->m_started;
+		}
+
+	if (!ours)
+		return;
+
+	if (linked)
+	{
+		//hold it still, as when linking, so we can see where it is
+		cs = readl(pChannel->m_pBase + DMA_REG_CS) & ~(DMA_CS_END | DMA_CS_INT);
+		writel(cs & ~DMA_CS_ACTIVE, pChannel->m_pBase + DMA_REG_CS);
+		conblk = readl(pChannel->m_pBase + DMA_REG_CONBLK_AD);
+
+		pHead = list_first_entry(pQueue, struct DmaJob, m_list);
+
+		//it may have gone on into what's linked behind the head since the queue last looked
+		while (conblk && pHead->m_poolCount && !DmaInPool(pHead, conblk) && !list_is_last(&pHead->m_list, pQueue)
+			&& list_entry(pHead->m_list.next, struct DmaJob, m_list)->m_started)
+		{
+			DmaRetireJob(pHead, 0);
+			pHead = list_first_entry(pQueue, struct DmaJob, m_list);
+			pHead->m_startTime = jiffies;
+		}
+
+		if (!conblk)
+		{
+			//it ran off the end of everything it was given, none of which needs aborting
+			list_for_each_entry_safe(pJob, pNext, pQueue, m_list)
+				if (pJob->m_started)
+					DmaRetireJob(pJob, 0);
+			restart = 1;
+		}
+		else if (pHead->m_pCtx == pCtx)
+		{
+			//ours is the one running, so the engine has to stop, anyone else's linked behind is started again afterwards
+			PRINTK(KERN_WARNING "aborting dma channel %d, cs %08x\n", pChannel->m_chan, readl(pChannel->m_pBase + DMA_REG_CS));
+			writel(DMA_CS_RESET, pChannel->m_pBase + DMA_REG_CS);
+			DmaUnlinkAfter(pChannel, pHead);
+
+			list_for_each_entry(pJob, pQueue, m_list)
+				pJob->m_started = 0;
+			restart = 1;
+		}
+		else
+		{
+			//someone else's is running, cut what's linked behind it and let it carry on
+			DmaUnlinkAfter(pChannel, pHead);
+			if (pHead->m_poolCount && conblk == CbPoolBus(pHead->m_poolFirst + pHead->m_poolCount - 1))
+				writel(0, pChannel->m_pBase + DMA_REG_NEXTCONBK);
+
+			list_for_each_entry(pJob, pQueue, m_list)
+				if (pJob != pHead)
+					pJob->m_started = 0;
+
+			writel(cs | DMA_CS_ACTIVE, pChannel->m_pBase + DMA_REG_CS);
+		}
+	}
+
+	//nothing points at them any more
+	list_for_each_entry_safe(pJob, pNext, pQueue, m_list)
+		if (pJob->m_pCtx == pCtx)
+			DmaRetireJob(pJob, -EIO);
+
+	//whatever is left carries on as if it had been queued behind
+	if (restart)
+		DmaStartHead(pChannel);
+}
+
+//throw away everything a file has queued, without disturbing anyone else's work
+static void DmaAbortCtx(struct DmaContext *pCtx)
+{
+	unsigned long flags;
+	int count;
+
+	spin_lock_irqsave(&g_jobLock, flags);
+
+	for (count = 0; count < g_numChannels; count++)
+		DmaAbortCtxChannel(&g_channels[count], pCtx);
+
+	DmaUnlockJobs(flags);
+
+	//callers go on to free what the jobs used, so any still having their cache maintenance done have to be out of the way
+	flush_work(&g_autoCacheWork);
+
+	wake_up(&g_dmaWaitQueue);
+}
+
+//throw away the work of any file whose job has been on an engine far longer than any should take
+//its owner may never wait for it, and everyone queued behind it would wait for ever
+static void DmaAbortHogs(void)
+{
+	struct DmaContext *pHog;
+	struct DmaJob *pJob;
+	unsigned long flags;
+	int count, other, aborted = 0;
+
+	spin_lock_irqsave(&g_jobLock, flags);
+
+	for (count = 0; count < g_numChannels; count++)
+	{
+		struct list_head *pQueue = &g_channels[count].m_jobQueue;
+
+		if (list_empty(pQueue))
+			continue;
+
+		pJob = list_first_entry(pQueue, struct DmaJob, m_list);
+		if (!pJob->m_started || !time_after(jiffies, pJob->m_startTime + msecs_to_jiffies(DMA_HOG_TIMEOUT_MS)))
+			continue;
+
+		//only a key from here, and it can't be freed while the lock keeps its job queued
+		pHog = pJob->m_pCtx;
+		PRINTK(KERN_WARNING "dma channel %d held for too long, aborting its file\n", g_channels[count].m_chan);
+
+		for (other = 0; other < g_numChannels; other++)
+			DmaAbortCtxChannel(&g_channels[other], pHog);
+		aborted = 1;
+	}
+
+	DmaUnlockJobs(flags);
+
+	if (aborted)
+		wake_up(&g_dmaWaitQueue);
+}
+
+static irqreturn_t DmaIrq(int irq, void *pDevId)
+{
+	struct DmaChannel *pChannel = (struct DmaChannel *)pDevId;
+	unsigned int cs = readl(pChannel->m_pBase + DMA_REG_CS);
+	unsigned long flags;
+
+	//the line may be shared with other channels
+	if (!(cs & DMA_CS_INT))
+		return IRQ_NONE;
+
+	//retire what has finished and get the next chain going
+	//and pick up anything submitted while the lock was held
+	spin_lock_irqsave(&g_jobLock, flags);
+
+	//clear the interrupt, keeping the channel active in case it is still running
+	//only under the lock, as setting active would restart an engine paused for linking
+	writel(DMA_CS_INT | DMA_CS_ACTIVE, pChannel->m_pBase + DMA_REG_CS);
+
+	DmaServiceQueue(pChannel);
+	DmaTakeIncoming(pChannel);
+	DmaUnlockJobs(flags);
+
+	wake_up(&g_dmaWaitQueue);
+
+	return IRQ_HANDLED;
 }
 
 static long Ioctl(struct file *pFile, unsigned int cmd, unsigned long arg)
 {
+	struct DmaContext *pCtx = (struct DmaContext *)pFile->private_data;
 	int error = 0;
 	PRINTK_VERBOSE(KERN_DEBUG "ioctl cmd %x arg %lx\n", cmd, arg);
 
@@ -486,22 +3705,7 @@ static long Ioctl(struct file *pFile, unsigned int cmd, unsigned long arg)
 	case DMA_PREPARE_KICK:
 	case DMA_PREPARE_KICK_WAIT:
 		{
-			struct DmaControlBlock __user *pUCB = (struct DmaControlBlock *)arg;
-			int steps = 0;
-			unsigned long start_time = jiffies;
-			(void)start_time;
-
-			//flush our address cache
-			FlushAddrCache();
-
-			PRINTK_VERBOSE(KERN_DEBUG "dma prepare\n");
-
-			//do virtual to bus translation for each entry
-			do
-			{
-				pUCB = DmaPrepare(pUCB, &error);
-			} while (error == 0 && ++steps && pUCB);
-			PRINTK_VERBOSE(KERN_DEBUG "prepare done in %d steps, %ld\n", steps, jiffies - start_time);
+			error = DmaPrepareChain(pCtx, (struct DmaControlBlock __user *)arg);
 
 			//carry straight on if we want to kick too
 			if (cmd == DMA_PREPARE || error)
@@ -511,72 +3715,164 @@ static long Ioctl(struct file *pFile, unsigned int cmd, unsigned long arg)
 			}
 		}
 	case DMA_KICK:
-		PRINTK_VERBOSE(KERN_DEBUG "dma begin\n");
+		{
+			unsigned int fence;
 
-		if (cmd == DMA_KICK)
-			FlushAddrCache();
+			PRINTK_VERBOSE(KERN_DEBUG "dma begin\n");
 
-		DmaKick((struct DmaControlBlock __user *)arg);
-		
-		if (cmd != DMA_PREPARE_KICK_WAIT)
-			break;
-/*	case DMA_WAIT_ONE:
+#ifndef CONFIG_MMU_NOTIFIER
+			if (cmd == DMA_KICK)
+				FlushAddrCache(pCtx);
+#endif
+
+			if (DmaKick(pCtx, (struct DmaControlBlock __user *)arg, 0, 0, &fence))
+				return -EINVAL;
+			
+			//hand the fence back so the caller can wait on just this chain
+			if (cmd != DMA_PREPARE_KICK_WAIT)
+				return fence;
+
+			arg = fence;
+		}
+	case DMA_WAIT_ONE:
 		//PRINTK(KERN_DEBUG "dma wait one\n");
-		break;*/
+		if (!DmaFenceIssued(arg))
+		{
+			PRINTK(KERN_ERR "waiting on a fence which has not been issued: %ld\n", arg);
+			return -EINVAL;
+		}
+
+		if (DmaWait(pCtx, arg))
+			return -ETIMEDOUT;
+		break;
+	case DMA_GET_PROGRESS:
+		return DmaGetProgress(pCtx, (struct DmaProgress __user *)arg);
+	case DMA_CACHE_OP:
+		return DmaCacheOp(pCtx, (struct DmaCacheRangeList __user *)arg);
+	case DMA_SET_AUTO_CACHE:
+		pCtx->m_autoCache = arg != 0;
+		break;
+	case DMA_SET_MMAP_MODE:
+		if ((arg & DMA_MMAP_CACHE_MASK) > DMA_MMAP_UNCACHED
+			|| (arg & ~(DMA_MMAP_CACHE_MASK | DMA_MMAP_CONTIGUOUS | DMA_MMAP_POPULATE)))
+			return -EINVAL;
+		pCtx->m_mmapMode = arg;
+		break;
+	case DMA_SET_EVENTFD:
+	{
+		struct eventfd_ctx *pEventFd = 0, *pOld;
+		unsigned long flags;
+
+		if ((int)arg >= 0)
+		{
+			pEventFd = eventfd_ctx_fdget((int)arg);
+			if (IS_ERR(pEventFd))
+				return PTR_ERR(pEventFd);
+		}
+
+		//swapped under the job lock as retirement happens in the interrupt
+		spin_lock_irqsave(&g_jobLock, flags);
+		pOld = pCtx->m_pEventFd;
+		pCtx->m_pEventFd = pEventFd;
+		DmaUnlockJobs(flags);
+
+		if (pOld)
+			eventfd_ctx_put(pOld);
+		break;
+	}
 	case DMA_WAIT_ALL:
 		//PRINTK(KERN_DEBUG "dma wait all\n");
-		DmaWaitAll();
+		DmaWaitAll(pCtx);
 		break;
 	case DMA_MAX_BURST:
-		if (g_dmaChan == 0)
-			return 10;
-		else
-			return 5;
+		//the chain could go on any channel
+		return DmaMaxBurst(0);
 	case DMA_SET_MIN_PHYS:
-		g_pMinPhys = (void __user *)arg;
-		PRINTK(KERN_DEBUG "min/max user/phys bypass set to %p %p\n", g_pMinPhys, g_pMaxPhys);
+		pCtx->m_pMinPhys = (void __user *)arg;
+		PRINTK(KERN_DEBUG "min/max user/phys bypass set to %p %p\n", pCtx->m_pMinPhys, pCtx->m_pMaxPhys);
 		break;
 	case DMA_SET_MAX_PHYS:
-		g_pMaxPhys = (void __user *)arg;
-		PRINTK(KERN_DEBUG "min/max user/phys bypass set to %p %p\n", g_pMinPhys, g_pMaxPhys);
+		pCtx->m_pMaxPhys = (void __user *)arg;
+		PRINTK(KERN_DEBUG "min/max user/phys bypass set to %p %p\n", pCtx->m_pMinPhys, pCtx->m_pMaxPhys);
 		break;
 	case DMA_SET_PHYS_OFFSET:
-		g_physOffset = arg;
-		PRINTK(KERN_DEBUG "user/phys bypass offset set to %ld\n", g_physOffset);
+		pCtx->m_physOffset = arg;
+		PRINTK(KERN_DEBUG "user/phys bypass offset set to %ld\n", pCtx->m_physOffset);
 		break;
 	case DMA_CMA_SET_SIZE:
 	{
 		unsigned int pBusAddr;
 
-		if (g_cmaHandle)
+		if (pCtx->m_cmaHandle)
 		{
-			PRINTK(KERN_ERR "memory has already been allocated (handle %d)\n", g_cmaHandle);
+			PRINTK(KERN_ERR "memory has already been allocated (handle %d)\n", pCtx->m_cmaHandle);
 			return -EINVAL;
 		}
 
 		PRINTK(KERN_INFO "allocating %ld bytes of VC memory\n", arg * 4096);
 
 		//get the memory
-		if (AllocateVcMemory(&g_cmaHandle, arg * 4096, 4096, MEM_FLAG_L1_NONALLOCATING | MEM_FLAG_NO_INIT | MEM_FLAG_HINT_PERMALOCK))
+		if (AllocateVcMemory(&pCtx->m_cmaHandle, arg * 4096, 4096, MEM_FLAG_L1_NONALLOCATING | MEM_FLAG_NO_INIT | MEM_FLAG_HINT_PERMALOCK))
 		{
 			PRINTK(KERN_ERR "failed to allocate %ld bytes of VC memory\n", arg * 4096);
-			g_cmaHandle = 0;
+			pCtx->m_cmaHandle = 0;
 			return -EINVAL;
 		}
 
 		//get an address for it
 		PRINTK(KERN_INFO "trying to map VC memory\n");
 
-		if (LockVcMemory(&pBusAddr, g_cmaHandle))
+		if (LockVcMemory(&pBusAddr, pCtx->m_cmaHandle))
+		{
+			PRINTK(KERN_ERR "failed to map CMA handle %d, releasing memory\n", pCtx->m_cmaHandle);
+			ReleaseVcMemory(pCtx->m_cmaHandle);
+			pCtx->m_cmaHandle = 0;
+		}
+
+		PRINTK(KERN_INFO "bus address for CMA memory is %x\n", pBusAddr);
+		return pBusAddr;
+	}
+	case DMA_RING_ENTER:
+		if (!pCtx->m_pRings)
 		{
-			PRINTK(KERN_ERR "failed to map CMA handle %d, releasing memory\n", g_cmaHandle);
-			ReleaseVcMemory(g_cmaHandle);
-			g_cmaHandle = 0;
+			PRINTK(KERN_ERR "rings have not been mapped\n");
+			return -EINVAL;
 		}
+		mutex_lock(&pCtx->m_ringLock);
+		error = DmaRingEnter(pCtx);
+		mutex_unlock(&pCtx->m_ringLock);
+		return error;
+	case DMA_CHAIN_REGISTER:
+		return ChainRegister(pCtx, (struct DmaControlBlock __user *)arg);
+	case DMA_CHAIN_KICK:
+		return ChainKick(pCtx, arg);
+	case DMA_CHAIN_UPDATE:
+		return ChainUpdate(pCtx, (struct DmaChainUpdate __user *)arg);
+	case DMA_CHAIN_UNREGISTER:
+		return ChainUnregister(pCtx, arg);
+	case DMA_CHAIN_CYCLE:
+		return ChainCycle(pCtx, arg);
+	case DMA_CHAIN_POSITION:
+		return ChainPosition(pCtx, arg);
+	case DMA_CHAIN_STOP:
+		return ChainStop(pCtx, arg);
+	case DMA_SUBMIT_DESCRIPTORS:
+		return DmaSubmitDescriptors(pCtx, (struct DmaDescriptorList __user *)arg);
+	case DMA_PREPARE_ARRAY:
+		return DmaPrepareArray(pCtx, (struct DmaPrepareArray __user *)arg);
+	case DMA_SUBMIT_COPIES:
+		return DmaSubmitCopies(pCtx, (struct DmaCopyList __user *)arg);
+	case DMA_REGISTER_BUFFER:
+	{
+		struct DmaBufferRegistration reg;
+
+		if (copy_from_user(&reg, (void __user *)arg, sizeof(reg)) != 0)
+			return -EFAULT;
 
-		PRINTK(KERN_INFO "bus address for CMA memory is %x\n", pBusAddr);
-		return pBusAddr;
+		return RegisterFixedBuffer(pCtx, reg.m_pAddr, reg.m_length);
 	}
+	case DMA_UNREGISTER_BUFFER:
+		return UnregisterFixedBuffer(pCtx, arg);
 	case DMA_GET_VERSION:
 		PRINTK(KERN_DEBUG "returning version number, %d\n", VERSION_NUMBER);
 		return VERSION_NUMBER;
@@ -588,34 +3884,106 @@ static long Ioctl(struct file *pFile, unsigned int cmd, unsigned long arg)
 	return 0;
 }
 
+//hands back the fences which have retired since the last read, as unsigned ints
+//blocks until there is at least one, unless the file is non-blocking
 static ssize_t Read(struct file *pFile, char __user *pUser, size_t count, loff_t *offp)
 {
-	return -EIO;
+	struct DmaContext *pCtx = (struct DmaContext *)pFile->private_data;
+	unsigned int fences[64];
+	unsigned int taken = 0;
+	unsigned long flags;
+
+	if (count < sizeof(unsigned int))
+		return -EINVAL;
+
+	if (count > sizeof(fences))
+		count = sizeof(fences);
+
+	//another reader may get there first, in which case go back to waiting
+	while (1)
+	{
+		spin_lock_irqsave(&g_jobLock, flags);
+		while (taken < count / sizeof(unsigned int) && pCtx->m_retiredHead != pCtx->m_retiredTail)
+			fences[taken++] = pCtx->m_retired[pCtx->m_retiredHead++ & (DMA_RETIRED_ENTRIES - 1)];
+		DmaUnlockJobs(flags);
+
+		if (taken)
+			break;
+
+		if (pFile->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+
+		if (wait_event_interruptible(pCtx->m_retiredWait,
+				ACCESS_ONCE(pCtx->m_retiredTail) != ACCESS_ONCE(pCtx->m_retiredHead)))
+			return -ERESTARTSYS;
+	}
+
+	if (copy_to_user(pUser, fences, taken * sizeof(unsigned int)) != 0)
+		return -EFAULT;
+
+	return taken * sizeof(unsigned int);
+}
+
+static unsigned int Poll(struct file *pFile, poll_table *pWait)
+{
+	struct DmaContext *pCtx = (struct DmaContext *)pFile->private_data;
+
+	poll_wait(pFile, &pCtx->m_retiredWait, pWait);
+
+	if (ACCESS_ONCE(pCtx->m_retiredTail) != ACCESS_ONCE(pCtx->m_retiredHead))
+		return POLLIN | POLLRDNORM;
+
+	return 0;
+}
+
+static int Fasync(int fd, struct file *pFile, int on)
+{
+	struct DmaContext *pCtx = (struct DmaContext *)pFile->private_data;
+
+	return fasync_helper(fd, pFile, on, &pCtx->m_pFasync);
+}
+
+static int MmapRings(struct DmaContext *pCtx, struct vm_area_struct *pVma)
+{
+	unsigned long size = PAGE_ALIGN(sizeof(struct DmaRings));
+
+	if (pVma->vm_end - pVma->vm_start != size)
+	{
+		PRINTK(KERN_ERR "ring mapping must be %ld bytes\n", size);
+		return -EINVAL;
+	}
+
+	if (!pCtx->m_pRings)
+	{
+		pCtx->m_pRings = (struct DmaRings *)__get_free_pages(GFP_KERNEL | __GFP_ZERO, get_order(sizeof(struct DmaRings)));
+		if (!pCtx->m_pRings)
+		{
+			PRINTK(KERN_ERR "couldn\'t allocate the rings (%s %d)\n",
+				current->comm, current->pid);
+			return -ENOMEM;
+		}
+	}
+
+	pVma->vm_flags |= VM_RESERVED | VM_DONTEXPAND;
+
+	return remap_pfn_range(pVma, pVma->vm_start,
+		virt_to_phys(pCtx->m_pRings) >> PAGE_SHIFT,
+		size, pVma->vm_page_prot);
 }
 
 static int Mmap(struct file *pFile, struct vm_area_struct *pVma)
 {
-	struct PageList *pPages;
+	struct DmaContext *pCtx = (struct DmaContext *)pFile->private_data;
 	struct VmaPageList *pVmaList;
 	
+	if (pVma->vm_pgoff == DMA_RING_MMAP_OFFSET >> PAGE_SHIFT)
+		return MmapRings(pCtx, pVma);
+
 	PRINTK_VERBOSE(KERN_DEBUG "MMAP vma %p, length %ld (%s %d)\n",
 		pVma, pVma->vm_end - pVma->vm_start,
 		current->comm, current->pid);
 	PRINTK_VERBOSE(KERN_DEBUG "MMAP %p %d (tracked %d)\n", pVma, current->pid, g_trackedPages);
 
-	//make a new page list
-	pPages = (struct PageList *)kmalloc(sizeof(struct PageList), GFP_KERNEL);
-	if (!pPages)
-	{
-		PRINTK(KERN_ERR "couldn\'t allocate a new page list (%s %d)\n",
-			current->comm, current->pid);
-		return -ENOMEM;
-	}
-
-	//clear the page list
-	pPages->m_used = 0;
-	pPages->m_pNext = 0;
-	
 	//insert our vma and new page list somewhere
 	if (!pVma->vm_private_data)
 	{
@@ -625,34 +3993,146 @@ static int Mmap(struct file *pFile, struct vm_area_struct *pVma)
 			current->comm, current->pid);
 
 		//make a new vma list
-		pList = (struct VmaPageList *)kmalloc(sizeof(struct VmaPageList), GFP_KERNEL);
+		pList = (struct VmaPageList *)kzalloc(sizeof(struct VmaPageList), GFP_KERNEL);
 		if (!pList)
 		{
 			PRINTK(KERN_ERR "couldn\'t allocate vma page list (%s %d)\n",
 				current->comm, current->pid);
-			kfree(pPages);
 			return -ENOMEM;
 		}
 
-		//clear this list
+		//nodes are preloaded before the vma lock is taken, so never need to sleep
+		INIT_RADIX_TREE(&pList->m_pages, GFP_ATOMIC);
+		INIT_LIST_HEAD(&pList->m_vmas);
+
 		pVma->vm_private_data = (void *)pList;
-		pList->m_refCount = 0;
+		pList->m_basePgoff = pVma->vm_pgoff;
+		pList->m_sizePages = (pVma->vm_end - pVma->vm_start) >> PAGE_SHIFT;
+		pList->m_mode = pCtx->m_mmapMode;
 	}
 
 	pVmaList = (struct VmaPageList *)pVma->vm_private_data;
 
-	//add it to the vma list
-	pVmaList->m_pPageHead = pPages;
-	pVmaList->m_pPageTail = pPages;
-
 	pVma->vm_ops = &g_vmOps4k;
-	pVma->vm_flags |= VM_RESERVED;
+	//offsets past the mapping as it is now are refused
+	pVma->vm_flags |= VM_RESERVED | VM_DONTEXPAND;
+
+	if ((pVmaList->m_mode & DMA_MMAP_CACHE_MASK) == DMA_MMAP_WRITECOMBINE)
+		pVma->vm_page_prot = pgprot_writecombine(pVma->vm_page_prot);
+	else if ((pVmaList->m_mode & DMA_MMAP_CACHE_MASK) == DMA_MMAP_UNCACHED)
+		pVma->vm_page_prot = pgprot_noncached(pVma->vm_page_prot);
+
+	if ((pVmaList->m_mode & (DMA_MMAP_CONTIGUOUS | DMA_MMAP_POPULATE))
+		&& (VmaFillContiguous(pVmaList, pVmaList->m_sizePages)
+			|| ((pVmaList->m_mode & DMA_MMAP_POPULATE) && VmaInsertAll(pVma, pVmaList))))
+	{
+		//the page tables are torn down with the vma, the pages are ours to give back
+		PRINTK(KERN_ERR "couldn\'t fill a mapping of %ld bytes (%s %d)\n",
+			pVma->vm_end - pVma->vm_start, current->comm, current->pid);
+		VmaFreeRange(pVmaList, 0, pVmaList->m_sizePages);
+		kfree(pVmaList);
+		pVma->vm_private_data = 0;
+		return -ENOMEM;
+	}
 
 	VmaOpen4k(pVma);
 
 	return 0;
 }
 
+/****** PAGE POOL ******/
+//zero the dirty pages, off the fault path
+static void PagePoolZero(struct work_struct *pWork)
+{
+	struct page *pPage;
+
+	while (1)
+	{
+		spin_lock(&g_poolLock);
+		pPage = list_empty(&g_poolDirty) ? 0 : list_first_entry(&g_poolDirty, struct page, lru);
+		if (pPage)
+			list_del(&pPage->lru);
+		spin_unlock(&g_poolLock);
+
+		if (!pPage)
+			break;
+
+		clear_highpage(pPage);
+
+		spin_lock(&g_poolLock);
+		list_add(&pPage->lru, &g_poolClean);
+		spin_unlock(&g_poolLock);
+	}
+}
+
+//a zeroed page, from the pool if it has one
+static struct page *PagePoolGet(void)
+{
+	struct page *pPage = 0;
+	int dirty = 0;
+
+	spin_lock(&g_poolLock);
+
+	if (!list_empty(&g_poolClean))
+		pPage = list_first_entry(&g_poolClean, struct page, lru);
+	//the zeroing hasn't caught up, it's still quicker to do it here than to allocate
+	else if (!list_empty(&g_poolDirty))
+	{
+		pPage = list_first_entry(&g_poolDirty, struct page, lru);
+		dirty = 1;
+	}
+
+	if (pPage)
+	{
+		list_del(&pPage->lru);
+		g_poolPages--;
+	}
+
+	spin_unlock(&g_poolLock);
+
+	if (!pPage)
+		return alloc_page(GFP_KERNEL | __GFP_ZERO);
+
+	if (dirty)
+		clear_highpage(pPage);
+
+	return pPage;
+}
+
+//give back a page whose only reference is ours
+static void PagePoolPut(struct page *pPage)
+{
+	//someone else still has hold of it, or the pool is full
+	if (page_count(pPage) != 1 || ACCESS_ONCE(g_poolPages) >= g_poolCap)
+	{
+		__free_pages(pPage, 0);
+		return;
+	}
+
+	spin_lock(&g_poolLock);
+	list_add(&pPage->lru, &g_poolDirty);
+	g_poolPages++;
+	spin_unlock(&g_poolLock);
+
+	schedule_work(&g_poolZeroWork);
+}
+
+static void PagePoolDrain(void)
+{
+	struct page *pPage, *pNext;
+
+	cancel_work_sync(&g_poolZeroWork);
+
+	list_for_each_entry_safe(pPage, pNext, &g_poolDirty, lru)
+		__free_pages(pPage, 0);
+	list_for_each_entry_safe(pPage, pNext, &g_poolClean, lru)
+		__free_pages(pPage, 0);
+
+	INIT_LIST_HEAD(&g_poolDirty);
+	INIT_LIST_HEAD(&g_poolClean);
+	g_poolPages = 0;
+}
+
 /****** VMA OPERATIONS ******/
 
 static void VmaOpen4k(struct vm_area_struct *pVma)
@@ -668,8 +4148,28 @@ static void VmaOpen4k(struct vm_area_struct *pVma)
 
 	if (pVmaList)
 	{
-		pVmaList->m_refCount++;
-		PRINTK_VERBOSE(KERN_DEBUG "ref count is now %d\n", pVmaList->m_refCount);
+		struct VmaEntry *pEntry;
+		unsigned int refs;
+
+		//so a partial unmap of a sibling can tell which pages it still maps
+		pEntry = (struct VmaEntry *)kmalloc(sizeof(struct VmaEntry), GFP_KERNEL);
+		if (pEntry)
+			pEntry->m_pVma = pVma;
+		else
+			PRINTK(KERN_WARNING "couldn\'t track vma %p (%s %d)\n",
+				pVma, current->comm, current->pid);
+
+		//a fork opens under its parent's mmap_sem, which doesn't keep out a close in another mm
+		spin_lock(&g_vmaLock);
+		refs = ++pVmaList->m_refCount;
+		if (pEntry)
+			list_add(&pEntry->m_list, &pVmaList->m_vmas);
+		else
+			//nor can we tell what it still maps, so nothing is freed until the end
+			pVmaList->m_untracked++;
+		spin_unlock(&g_vmaLock);
+
+		PRINTK_VERBOSE(KERN_DEBUG "ref count is now %d\n", refs);
 	}
 	else
 	{
@@ -677,15 +4177,164 @@ static void VmaOpen4k(struct vm_area_struct *pVma)
 	}
 }
 
+//take the pages at offsets [first, end) out of a mapping, giving them back, returning how many there were
+static int VmaFreeRange(struct VmaPageList *pVmaList, unsigned long first, unsigned long end)
+{
+	struct page *pBatch[DMA_FREE_BATCH];
+	unsigned int found, count, taken;
+	int freed = 0;
+
+	do
+	{
+		taken = 0;
+
+		//pages know their own offset, the lookup only hands back the pages
+		spin_lock(&g_vmaLock);
+		found = radix_tree_gang_lookup(&pVmaList->m_pages, (void **)pBatch, first, DMA_FREE_BATCH);
+		for (count = 0; count < found && pBatch[count]->index < end; count++)
+		{
+			radix_tree_delete(&pVmaList->m_pages, pBatch[count]->index);
+			pVmaList->m_numPages--;
+			g_trackedPages--;
+			taken++;
+		}
+		spin_unlock(&g_vmaLock);
+
+		if (taken)
+			first = pBatch[taken - 1]->index + 1;
+
+		for (count = 0; count < taken; count++)
+		{
+			PRINTK_VERBOSE(KERN_DEBUG "freeing page %p (%s %d)\n",
+				pBatch[count], current->comm, current->pid);
+			PagePoolPut(pBatch[count]);
+		}
+
+		freed += taken;
+	} while (taken == DMA_FREE_BATCH);
+
+	return freed;
+}
+
+//put a page into a mapping at an offset, unless one beat it there
+//returns whichever page is there, with a reference for the caller, or zero if out of memory
+static struct page *VmaFilePage(struct VmaPageList *pVmaList, unsigned long index, struct page *pPage)
+{
+	struct page *pFound;
+
+	if (radix_tree_preload(GFP_KERNEL))
+		return 0;
+
+	spin_lock(&g_vmaLock);
+
+	pFound = (struct page *)radix_tree_lookup(&pVmaList->m_pages, index);
+	if (!pFound)
+	{
+		PRINTK_VERBOSE(KERN_DEBUG "adding page to list (%s %d)\n", current->comm, current->pid);
+
+		//preloaded, so it can't fail for want of memory
+		pPage->index = index;
+		radix_tree_insert(&pVmaList->m_pages, index, pPage);
+		pVmaList->m_numPages++;
+		g_trackedPages++;
+		pFound = pPage;
+	}
+
+	//one reference for the tree, one for the caller
+	get_page(pFound);
+
+	spin_unlock(&g_vmaLock);
+	radix_tree_preload_end();
+
+	return pFound;
+}
+
+//back a whole new mapping with the largest physically contiguous blocks going, split into single pages
+//so they are freed, faulted and translated like any other
+//returns non-zero if even single pages ran out
+static int VmaFillContiguous(struct VmaPageList *pVmaList, unsigned long numPages)
+{
+	unsigned long index = 0;
+	unsigned int order = DMA_CONTIG_MAX_ORDER;
+
+	while (index < numPages)
+	{
+		struct page *pBlock;
+		unsigned long count;
+
+		//no bigger than what's left
+		while (order && (1UL << order) > numPages - index)
+			order--;
+
+		pBlock = alloc_pages(GFP_KERNEL | __GFP_NOWARN | (order ? __GFP_NORETRY : 0), order);
+		if (!pBlock)
+		{
+			if (!order)
+				return 1;
+
+			//try smaller, and stay there as the bigger ones have gone
+			order--;
+			continue;
+		}
+
+		PRINTK_VERBOSE(KERN_DEBUG "contiguous block of order %d at page %ld\n", order, index);
+		split_page(pBlock, order);
+
+		if ((pVmaList->m_mode & DMA_MMAP_CACHE_MASK) != DMA_MMAP_CACHED)
+			__cpuc_flush_dcache_area(page_address(pBlock), PAGE_SIZE << order);
+
+		for (count = 0; count < (1UL << order); count++, index++)
+		{
+			if (!VmaFilePage(pVmaList, index, pBlock + count))
+			{
+				//the rest of the block isn't filed anywhere yet
+				for (; count < (1UL << order); count++)
+					__free_pages(pBlock + count, 0);
+				return 1;
+			}
+
+			//nobody else can have got there first, keep only the tree's reference
+			put_page(pBlock + count);
+		}
+	}
+
+	return 0;
+}
+
+//does any other live vma still map part of [first, end) of this mapping
+//must be called with the vma lock held, and the closing mm's mmap_sem held for writing as it is in close
+//the bounds of another mm's vmas can't be read safely, so a fork counts as mapping everything
+static int VmaRangeShared(struct VmaPageList *pVmaList, struct mm_struct *pMm, unsigned long first, unsigned long end)
+{
+	struct VmaEntry *pEntry;
+
+	list_for_each_entry(pEntry, &pVmaList->m_vmas, m_list)
+	{
+		struct vm_area_struct *pVma = pEntry->m_pVma;
+		unsigned long start;
+
+		if (pVma->vm_mm != pMm)
+			return 1;
+
+		start = pVma->vm_pgoff - pVmaList->m_basePgoff;
+		if (start < end && start + ((pVma->vm_end - pVma->vm_start) >> PAGE_SHIFT) > first)
+			return 1;
+	}
+
+	return 0;
+}
+
 static void VmaClose4k(struct vm_area_struct *pVma)
 {
+	struct DmaContext *pCtx = (struct DmaContext *)pVma->vm_file->private_data;
 	struct VmaPageList *pVmaList;
+	struct VmaEntry *pEntry;
 	int freed = 0;
 	
 	PRINTK_VERBOSE(KERN_DEBUG "vma close %p private %p (%s %d)\n", pVma, pVma->vm_private_data, current->comm, current->pid);
 	
 	//wait for any dmas to finish
-	DmaWaitAll();
+	DmaWaitAll(pCtx);
 
 	//find our vma in the list
 	pVmaList = (struct VmaPageList *)pVma->vm_private_data;
@@ -693,48 +4342,26 @@ static void VmaClose4k(struct vm_area_struct *pVma)
 	//may be a fork
 	if (pVmaList)
 	{
-		struct PageList *pPages;
-		
-		pVmaList->m_refCount--;
-
-		if (pVmaList->m_refCount == 0)
-		{
-			PRINTK_VERBOSE(KERN_DEBUG "found vma, freeing pages (%s %d)\n",
-				current->comm, current->pid);
+		unsigned int refs;
 
-			pPages = pVmaList->m_pPageHead;
-
-			if (!pPages)
+		//no longer one of its users, dropped along with the reference so an open in a fork can't get in between
+		spin_lock(&g_vmaLock);
+		list_for_each_entry(pEntry, &pVmaList->m_vmas, m_list)
+			if (pEntry->m_pVma == pVma)
 			{
-				PRINTK(KERN_ERR "no page list (%s %d)!\n",
-					current->comm, current->pid);
-				return;
+				list_del(&pEntry->m_list);
+				kfree(pEntry);
+				break;
 			}
+		refs = --pVmaList->m_refCount;
+		spin_unlock(&g_vmaLock);
 
-			while (pPages)
-			{
-				struct PageList *next;
-				int count;
-
-				PRINTK_VERBOSE(KERN_DEBUG "page list (%s %d)\n",
-					current->comm, current->pid);
-
-				next = pPages->m_pNext;
-				for (count = 0; count < pPages->m_used; count++)
-				{
-					PRINTK_VERBOSE(KERN_DEBUG "freeing page %p (%s %d)\n",
-						pPages->m_pPages[count],
-						current->comm, current->pid);
-					__free_pages(pPages->m_pPages[count], 0);
-					g_trackedPages--;
-					freed++;
-				}
+		if (refs == 0)
+		{
+			PRINTK_VERBOSE(KERN_DEBUG "found vma, freeing pages (%s %d)\n",
+				current->comm, current->pid);
 
-				PRINTK_VERBOSE(KERN_DEBUG "freeing page list (%s %d)\n",
-					current->comm, current->pid);
-				kfree(pPages);
-				pPages = next;
-			}
+			freed = VmaFreeRange(pVmaList, 0, pVmaList->m_sizePages);
 			
 			//remove our vma from the list
 			kfree(pVmaList);
@@ -742,7 +4369,19 @@ static void VmaClose4k(struct vm_area_struct *pVma)
 		}
 		else
 		{
-			PRINTK_VERBOSE(KERN_DEBUG "ref count is %d, not closing\n", pVmaList->m_refCount);
+			//part of the mapping has been unmapped, its pages can go unless a fork or a move still maps them
+			unsigned long first = pVma->vm_pgoff - pVmaList->m_basePgoff;
+			unsigned long end = first + ((pVma->vm_end - pVma->vm_start) >> PAGE_SHIFT);
+			int shared;
+
+			spin_lock(&g_vmaLock);
+			shared = pVmaList->m_untracked || VmaRangeShared(pVmaList, pVma->vm_mm, first, end);
+			spin_unlock(&g_vmaLock);
+
+			if (!shared)
+				freed = VmaFreeRange(pVmaList, first, end);
+
+			PRINTK_VERBOSE(KERN_DEBUG "ref count is %d, not closing\n", refs);
 		}
 	}
 	else
@@ -757,64 +4396,150 @@ static void VmaClose4k(struct vm_area_struct *pVma)
 	PRINTK_VERBOSE(KERN_DEBUG "%d pages open\n", g_trackedPages);
 }
 
+//the page filed at an offset into the mapping, allocating and filing one if there isn't one yet
+//returns it with a reference for the caller, or zero if out of memory
+static struct page *VmaGetPage(struct VmaPageList *pVmaList, unsigned long index)
+{
+	struct page *pPage, *pFound;
+
+	//contiguous and populated mappings were filled in when they were made
+	if (pVmaList->m_mode & (DMA_MMAP_CONTIGUOUS | DMA_MMAP_POPULATE))
+	{
+		spin_lock(&g_vmaLock);
+		pFound = (struct page *)radix_tree_lookup(&pVmaList->m_pages, index);
+		if (pFound)
+			get_page(pFound);
+		spin_unlock(&g_vmaLock);
+
+		return pFound;
+	}
+
+	pPage = PagePoolGet();
+	
+	if (!pPage)
+	{
+		PRINTK(KERN_ERR "vma fault oom (%s %d)\n", current->comm, current->pid);
+		return 0;
+	}
+
+	PRINTK_VERBOSE(KERN_DEBUG "alloc page virtual %p\n", page_address(pPage));
+
+	//the kernel's cached alias mustn't write anything back over the page once it's mapped uncached
+	if ((pVmaList->m_mode & DMA_MMAP_CACHE_MASK) != DMA_MMAP_CACHED)
+		__cpuc_flush_dcache_area(page_address(pPage), PAGE_SIZE);
+
+	pFound = VmaFilePage(pVmaList, index, pPage);
+
+	//another thread faulted the same page first, hand back that one instead
+	if (pFound != pPage)
+		PagePoolPut(pPage);
+
+	return pFound;
+}
+
+//put every page of a newly filled mapping into the page tables now, rather than a fault at a time
+static int VmaInsertAll(struct vm_area_struct *pVma, struct VmaPageList *pVmaList)
+{
+	unsigned long index;
+
+	for (index = 0; index < pVmaList->m_sizePages; index++)
+	{
+		struct page *pPage = (struct page *)radix_tree_lookup(&pVmaList->m_pages, index);
+
+		//the mapping takes its own reference
+		if (!pPage || vm_insert_page(pVma, pVma->vm_start + (index << PAGE_SHIFT), pPage))
+			return 1;
+	}
+
+	return 0;
+}
+
 static int VmaFault4k(struct vm_area_struct *pVma, struct vm_fault *pVmf)
 {
+	struct VmaPageList *pVmaList;
+	unsigned long index;
+
 	PRINTK_VERBOSE(KERN_DEBUG "vma fault for vma %p private %p at offset %ld (%s %d)\n", pVma, pVma->vm_private_data, pVmf->pgoff,
 		current->comm, current->pid);
 	PRINTK_VERBOSE(KERN_DEBUG "FAULT\n");
-	pVmf->page = alloc_page(GFP_KERNEL);
-	
-	if (pVmf->page)
+
+	//find our vma in the list
+	pVmaList = (struct VmaPageList *)pVma->vm_private_data;
+
+	if (!pVmaList)
 	{
-		PRINTK_VERBOSE(KERN_DEBUG "alloc page virtual %p\n", page_address(pVmf->page));
+		PRINTK(KERN_ERR "fault for vma we don\'t know %p (%s %d)\n", pVma, current->comm, current->pid);
+		return VM_FAULT_SIGBUS;
 	}
 
-	if (!pVmf->page)
+	index = pVmf->pgoff - pVmaList->m_basePgoff;
+	if (pVmf->pgoff < pVmaList->m_basePgoff || index >= pVmaList->m_sizePages)
 	{
-		PRINTK(KERN_ERR "vma fault oom (%s %d)\n", current->comm, current->pid);
-		return VM_FAULT_OOM;
+		PRINTK(KERN_ERR "fault at offset %ld is outside the mapping (%s %d)\n", pVmf->pgoff, current->comm, current->pid);
+		return VM_FAULT_SIGBUS;
 	}
-	else
+
+	//the reference is handed on to the mapping
+	pVmf->page = VmaGetPage(pVmaList, index);
+	if (!pVmf->page)
+		return (pVmaList->m_mode & (DMA_MMAP_CONTIGUOUS | DMA_MMAP_POPULATE)) ? VM_FAULT_SIGBUS : VM_FAULT_OOM;
+
+	return 0;
+}
+
+/****** GENERIC FUNCTIONS ******/
+//take as many channels as asked for, or as many as there are
+static void AllocChannels(void)
+{
+	int count;
+
+	for (count = 0; count < g_wantChannels && count < DMA_MAX_CHANNELS; count++)
 	{
-		struct VmaPageList *pVmaList;
-		
-		get_page(pVmf->page);
-		g_trackedPages++;
-		
-		//find our vma in the list
-		pVmaList = (struct VmaPageList *)pVma->vm_private_data;
-		
-		if (pVmaList)
+		struct DmaChannel *pChannel = &g_channels[g_numChannels];
+		int result;
+
+		//full channels are handed out first, then the lite ones
+		result = bcm_dma_chan_alloc(BCM_DMA_FEATURE_FAST, (void **)&pChannel->m_pBase, &pChannel->m_irq);
+		if (result < 0)
 		{
-			PRINTK_VERBOSE(KERN_DEBUG "vma found (%s %d)\n", current->comm, current->pid);
+			PRINTK(KERN_WARNING "only got %d of %d dma channels\n", g_numChannels, g_wantChannels);
+			break;
+		}
 
-			if (pVmaList->m_pPageTail->m_used == PAGES_PER_LIST)
-			{
-				PRINTK_VERBOSE(KERN_DEBUG "making new page list (%s %d)\n", current->comm, current->pid);
-				//making a new page list
-				pVmaList->m_pPageTail->m_pNext = (struct PageList *)kmalloc(sizeof(struct PageList), GFP_KERNEL);
-				if (!pVmaList->m_pPageTail->m_pNext)
-					return -ENOMEM;
-				
-				//update the tail pointer
-				pVmaList->m_pPageTail = pVmaList->m_pPageTail->m_pNext;
-				pVmaList->m_pPageTail->m_used = 0;
-				pVmaList->m_pPageTail->m_pNext = 0;
-			}
+		pChannel->m_chan = result;
+		atomic_set(&pChannel->m_queued, 0);
+		INIT_LIST_HEAD(&pChannel->m_jobQueue);
+		init_llist_head(&pChannel->m_incoming);
 
-			PRINTK_VERBOSE(KERN_DEBUG "adding page to list (%s %d)\n", current->comm, current->pid);
-			
-			pVmaList->m_pPageTail->m_pPages[pVmaList->m_pPageTail->m_used] = pVmf->page;
-			pVmaList->m_pPageTail->m_used++;
+		//reset the channel
+		PRINTK(KERN_DEBUG "allocated dma channel %d (%p), initial state %08x\n", result, pChannel->m_pBase, *pChannel->m_pBase);
+		writel(DMA_CS_RESET, pChannel->m_pBase + DMA_REG_CS);
+		PRINTK(KERN_DEBUG "post-reset %08x\n", *pChannel->m_pBase);
+
+		//waiters sleep until the last block of a chain raises an interrupt
+		result = request_irq(pChannel->m_irq, DmaIrq, IRQF_SHARED, "dmaer", pChannel);
+		if (result < 0)
+		{
+			PRINTK(KERN_ERR "failed to request dma irq %d\n", pChannel->m_irq);
+			bcm_dma_chan_free(pChannel->m_chan);
+			break;
 		}
-		else
-			PRINTK(KERN_ERR "returned page for vma we don\'t know %p (%s %d)\n", pVma, current->comm, current->pid);
-		
-		return 0;
+
+		g_numChannels++;
+	}
+}
+
+static void FreeChannels(void)
+{
+	while (g_numChannels)
+	{
+		struct DmaChannel *pChannel = &g_channels[--g_numChannels];
+
+		free_irq(pChannel->m_irq, pChannel);
+		bcm_dma_chan_free(pChannel->m_chan);
 	}
 }
 
-/****** GENERIC FUNCTIONS ******/
 static int __init dmaer_init(void)
 {
 	int result = alloc_chrdev_region(&g_majorMinor, 0, 1, "dmaer");
@@ -826,33 +4551,29 @@ static int __init dmaer_init(void)
 	else
 		PRINTK(KERN_DEBUG "major device number %d\n", MAJOR(g_majorMinor));
 	
-	PRINTK(KERN_DEBUG "vma list size %d, page list size %d, page size %ld\n",
-		sizeof(struct VmaPageList), sizeof(struct PageList), PAGE_SIZE);
+	PRINTK(KERN_DEBUG "vma list size %d, page size %ld\n",
+		sizeof(struct VmaPageList), PAGE_SIZE);
+
+	//the kernel-owned CBs, shared by every submission
+	g_pCbPool = (struct DmaControlBlock *)dma_alloc_coherent(0, DMA_CB_POOL_SIZE * sizeof(struct DmaControlBlock), &g_busCbPool, GFP_KERNEL);
+	if (!g_pCbPool)
+	{
+		PRINTK(KERN_ERR "failed to allocate cb pool\n");
+		unregister_chrdev_region(g_majorMinor, 1);
+		return -ENOMEM;
+	}
+	bitmap_zero(g_cbPoolMap, DMA_CB_POOL_SIZE);
 
-	//get a dma channel to work with
-	result = bcm_dma_chan_alloc(BCM_DMA_FEATURE_FAST, (void **)&g_pDmaChanBase, &g_dmaIrq);
+	//get the dma channels to work with
+	AllocChannels();
 
-	//uncomment to force to channel 0
-	//result = 0;
-	//g_pDmaChanBase = 0xce808000;
-	
-	if (result < 0)
+	if (g_numChannels == 0)
 	{
 		PRINTK(KERN_ERR "failed to allocate dma channel\n");
-		cdev_del(&g_cDev);
 		unregister_chrdev_region(g_majorMinor, 1);
+		dma_free_coherent(0, DMA_CB_POOL_SIZE * sizeof(struct DmaControlBlock), g_pCbPool, g_busCbPool);
+		return -EBUSY;
 	}
-	
-	//reset the channel
-	PRINTK(KERN_DEBUG "allocated dma channel %d (%p), initial state %08x\n", result, g_pDmaChanBase, *g_pDmaChanBase);
-	*g_pDmaChanBase = 1 << 31;
-	PRINTK(KERN_DEBUG "post-reset %08x\n", *g_pDmaChanBase);
-	
-	g_dmaChan = result;
-
-	//clear the cache stats
-	g_cacheHit = 0;
-	g_cacheMiss = 0;
 
 	//register our device - after this we are go go go
 	cdev_init(&g_cDev, &g_fOps);
@@ -864,7 +4585,8 @@ static int __init dmaer_init(void)
 	{
 		PRINTK(KERN_ERR "failed to add character device\n");
 		unregister_chrdev_region(g_majorMinor, 1);
-		bcm_dma_chan_free(g_dmaChan);
+		FreeChannels();
+		dma_free_coherent(0, DMA_CB_POOL_SIZE * sizeof(struct DmaControlBlock), g_pCbPool, g_busCbPool);
 		return result;
 	}
 		
@@ -873,12 +4595,17 @@ static int __init dmaer_init(void)
 
 static void __exit dmaer_exit(void)
 {
-	PRINTK(KERN_INFO "closing dmaer device, cache stats: %d hits %d misses\n", g_cacheHit, g_cacheMiss);
+	PRINTK(KERN_INFO "closing dmaer device\n");
 	//unregister the device
 	cdev_del(&g_cDev);
 	unregister_chrdev_region(g_majorMinor, 1);
-	//free the dma channel
-	bcm_dma_chan_free(g_dmaChan);
+	//every file is closed so nothing is left to retire, though the last may still be on its way out
+	cancel_work_sync(&g_autoCacheWork);
+	//free the dma channels
+	FreeChannels();
+	dma_free_coherent(0, DMA_CB_POOL_SIZE * sizeof(struct DmaControlBlock), g_pCbPool, g_busCbPool);
+	//nothing can be mapped any more
+	PagePoolDrain();
 }
 
 MODULE_LICENSE("Dual BSD/GPL");
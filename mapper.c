@@ -47,8 +47,8 @@
 //prepare it, kick it, don't wait for it
 #define DMA_PREPARE_KICK	_IOWR(DMA_MAGIC, 3, struct DmaControlBlock *)
 
-//not currently implemented
-#define DMA_WAIT_ONE		_IO(DMA_MAGIC, 4, struct DmaControlBlock *)
+//wait on a single kicked CB chain, identified by the fence returned from the kick
+#define DMA_WAIT_ONE		_IOW(DMA_MAGIC, 4, unsigned long)
 
 //wait on all kicked CB chains
 #define DMA_WAIT_ALL		_IO(DMA_MAGIC, 5)
@@ -60,6 +60,9 @@
 #define DMA_SET_MIN_PHYS	_IOW(DMA_MAGIC, 7, unsigned long)
 #define DMA_SET_MAX_PHYS	_IOW(DMA_MAGIC, 8, unsigned long)
 
+//as DMA_PREPARE, for CBs in a contiguous array
+#define DMA_PREPARE_ARRAY	_IOW(DMA_MAGIC, 19, struct DmaPrepareArray *)
+
 struct DmaControlBlock
 {
 	unsigned int m_transferInfo;
@@ -71,6 +74,12 @@ struct DmaControlBlock
 	unsigned int m_blank1, m_blank2;
 };
 
+struct DmaPrepareArray
+{
+	struct DmaControlBlock *m_pCBs;
+	unsigned int m_count;
+};
+
 #define MY_ASSERT(x) if (!(x)) { *(int *)0 = 0; }
 
 inline void CopyLinear(struct DmaControlBlock *pCB,
@@ -183,7 +192,11 @@ int main(int argc, char **argv)
     struct timeval start;
     gettimeofday(&start, 0);
     
-    err = ioctl(fileno(f), DMA_PREPARE, address);
+    struct DmaPrepareArray array;
+    array.m_pCBs = pHead;
+    array.m_count = transfer_size / 4096;
+
+    err = ioctl(fileno(f), DMA_PREPARE_ARRAY, &array);
     if (err == -1)
     {
     	fprintf(stderr, "dma prepare err %d\n", errno);
@@ -193,8 +206,8 @@ int main(int argc, char **argv)
     struct timeval mid;
     gettimeofday(&mid, 0);
     
-    err = ioctl(fileno(f), DMA_KICK, address);
-    if (err == -1)
+    int fence = ioctl(fileno(f), DMA_KICK, address);
+    if (fence == -1)
     {
     	fprintf(stderr, "dma kick err %d\n", errno);
         MY_ASSERT(0);
@@ -202,7 +215,7 @@ int main(int argc, char **argv)
 
 //    time_t end = clock();
     
-    ioctl(fileno(f), DMA_WAIT_ALL, address);
+    ioctl(fileno(f), DMA_WAIT_ONE, fence);
     
     struct timeval wait;
     gettimeofday(&wait, 0);